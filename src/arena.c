@@ -0,0 +1,53 @@
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+#define HUGE_PAGE (2 << 20)
+
+// The header lives at the start of its own mapping
+struct arena
+{
+  size_t size; // of the whole mapping
+  size_t used;
+};
+
+arena_t *
+arena_create (size_t size)
+{
+  size_t total = sizeof (struct arena) + size;
+  void *base = mmap (NULL, total, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    return NULL;
+
+  // large tables are walked at random; fewer TLB misses with huge pages
+#ifdef MADV_HUGEPAGE
+  if (total >= HUGE_PAGE)
+    madvise (base, total, MADV_HUGEPAGE);
+#endif
+
+  arena_t *arena = (arena_t *)base;
+  arena->size = total;
+  arena->used = sizeof (struct arena);
+  return arena;
+}
+
+void *
+arena_alloc (arena_t *arena, size_t size, size_t align)
+{
+  uintptr_t base = (uintptr_t)arena;
+  uintptr_t start = base + arena->used;
+  start = (start + align - 1) & ~(uintptr_t)(align - 1);
+  if (start + size > base + arena->size)
+    return NULL;
+  arena->used = start + size - base;
+  return (void *)start;
+}
+
+void
+arena_destroy (arena_t *arena)
+{
+  if (arena != NULL)
+    munmap (arena, arena->size);
+}
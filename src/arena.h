@@ -0,0 +1,22 @@
+#ifndef __cs361_arena_h__
+#define __cs361_arena_h__
+
+#include <stddef.h>
+
+// Bump allocator over a single anonymous mapping. Everything carved out
+// of an arena is freed at once by arena_destroy, so large tables never
+// fragment the heap. Memory starts zeroed and pages are only backed once
+// they are touched.
+
+typedef struct arena arena_t;
+
+// Map an arena with room for size bytes of allocations
+arena_t *arena_create (size_t size);
+
+// Carve size bytes aligned to align (a power of two) out of the arena.
+// Returns NULL once the arena is full.
+void *arena_alloc (arena_t *arena, size_t size, size_t align);
+
+void arena_destroy (arena_t *arena);
+
+#endif
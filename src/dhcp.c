@@ -26,33 +26,26 @@ dump_packet (uint8_t *ptr, size_t size)
   fprintf (stderr, "\n");
 }
 
+// Free one option value unless it points at the inline storage
+static void
+free_option (void **value, void *inline_value)
+{
+  if (*value != NULL && *value != inline_value)
+    free (*value);
+  *value = NULL;
+}
+
 void
 free_options (options_t *options)
 {
-  if (options->request != NULL)
-    {
-      free (options->request);
-      options->request = NULL;
-    }
-  if (options->lease != NULL)
-    {
-      free (options->lease);
-      options->lease = NULL;
-    }
-  if (options->type != NULL)
-    {
-      free (options->type);
-      options->type = NULL;
-    }
-  if (options->sid != NULL)
-    {
-      free (options->sid);
-      options->sid = NULL;
-    }
+  free_option ((void **)&options->request, &options->request_val);
+  free_option ((void **)&options->lease, &options->lease_val);
+  free_option ((void **)&options->type, &options->type_val);
+  free_option ((void **)&options->sid, &options->sid_val);
 }
 
 bool
-get_options (uint8_t *packet, uint8_t *end, options_t *options)
+parse_options (uint8_t *packet, uint8_t *end, options_t *options)
 {
   // check magic cookie
   uint32_t cookie;
@@ -87,23 +80,23 @@ get_options (uint8_t *packet, uint8_t *end, options_t *options)
 
       if (option_type == DHCP_opt_msgtype)
         {
-          options->type = malloc (1);
-          *options->type = *current;
+          options->type_val = *current;
+          options->type = &options->type_val;
         }
       else if (option_type == DHCP_opt_reqip)
         {
-          options->request = malloc (sizeof (struct in_addr));
-          memcpy (options->request, current, 4);
+          memcpy (&options->request_val, current, 4);
+          options->request = &options->request_val;
         }
       else if (option_type == DHCP_opt_lease)
         {
-          options->lease = malloc (4);
-          memcpy (options->lease, current, 4);
+          memcpy (&options->lease_val, current, 4);
+          options->lease = &options->lease_val;
         }
       else if (option_type == DHCP_opt_sid)
         {
-          options->sid = malloc (sizeof (struct in_addr));
-          memcpy (options->sid, current, 4);
+          memcpy (&options->sid_val, current, 4);
+          options->sid = &options->sid_val;
         }
       /* printf("parsed option %d, length %d\n", option_type, option_len); */
 
@@ -113,37 +106,69 @@ get_options (uint8_t *packet, uint8_t *end, options_t *options)
   return true;
 }
 
-uint8_t *
-append_cookie (uint8_t *packet, size_t *packet_size)
+// Move one parsed option value from the inline storage onto the heap
+static void *
+dup_option (void *value, size_t size)
 {
-  size_t newsize = *packet_size + 4;
-  uint8_t *newpacket = realloc (packet, newsize);
+  if (value == NULL)
+    return NULL;
+  void *copy = malloc (size);
+  memcpy (copy, value, size);
+  return copy;
+}
+
+bool
+get_options (uint8_t *packet, uint8_t *end, options_t *options)
+{
+  options_t parsed;
+  memset (&parsed, 0, sizeof (options_t));
+  if (!parse_options (packet, end, &parsed))
+    return false;
+
+  if (parsed.type != NULL)
+    options->type = dup_option (parsed.type, 1);
+  if (parsed.request != NULL)
+    options->request = dup_option (parsed.request, sizeof (struct in_addr));
+  if (parsed.lease != NULL)
+    options->lease = dup_option (parsed.lease, 4);
+  if (parsed.sid != NULL)
+    options->sid = dup_option (parsed.sid, sizeof (struct in_addr));
+
+  return true;
+}
+
+bool
+write_cookie (uint8_t *packet, size_t *packet_size, size_t capacity)
+{
+  if (*packet_size + 4 > capacity)
+    return false;
 
   uint32_t cookie = htonl (MAGIC_COOKIE);
-  memcpy (newpacket + *packet_size, &cookie, 4);
+  memcpy (packet + *packet_size, &cookie, 4);
 
-  *packet_size = newsize;
-  return newpacket;
+  *packet_size += 4;
+  return true;
 }
 
-uint8_t *
-append_option (uint8_t *packet, size_t *packet_size, uint8_t option,
-               uint8_t option_size, uint8_t *option_value)
+bool
+write_option (uint8_t *packet, size_t *packet_size, size_t capacity,
+              uint8_t option, uint8_t option_size, uint8_t *option_value)
 {
   if (option == DHCP_opt_end)
     {
-      size_t newsize = *packet_size + 1;
-      uint8_t *newpacket = realloc (packet, newsize);
-      newpacket[*packet_size] = DHCP_opt_end;
-      *packet_size = newsize;
-      return newpacket;
+      if (*packet_size + 1 > capacity)
+        return false;
+      packet[*packet_size] = DHCP_opt_end;
+      *packet_size += 1;
+      return true;
     }
 
   // code plus length than value
   size_t newsize = *packet_size + 2 + option_size;
-  uint8_t *newpacket = realloc (packet, newsize);
+  if (newsize > capacity)
+    return false;
 
-  uint8_t *position = newpacket + *packet_size;
+  uint8_t *position = packet + *packet_size;
   *position = option;
   position++;
   *position = option_size;
@@ -151,5 +176,29 @@ append_option (uint8_t *packet, size_t *packet_size, uint8_t option,
   memcpy (position, option_value, option_size);
 
   *packet_size = newsize;
+  return true;
+}
+
+uint8_t *
+append_cookie (uint8_t *packet, size_t *packet_size)
+{
+  size_t newsize = *packet_size + 4;
+  uint8_t *newpacket = realloc (packet, newsize);
+
+  write_cookie (newpacket, packet_size, newsize);
+  return newpacket;
+}
+
+uint8_t *
+append_option (uint8_t *packet, size_t *packet_size, uint8_t option,
+               uint8_t option_size, uint8_t *option_value)
+{
+  size_t newsize = *packet_size + 1;
+  if (option != DHCP_opt_end)
+    newsize = *packet_size + 2 + option_size;
+  uint8_t *newpacket = realloc (packet, newsize);
+
+  write_option (newpacket, packet_size, newsize, option, option_size,
+                option_value);
   return newpacket;
 }
@@ -88,6 +88,13 @@ typedef struct {
   uint32_t *lease;     //  DHCP: [51] IP Address Lease Time = 16 Days, 0:00:00
   uint8_t *type;       //  DHCP: [53] DHCP Message Type = DHCP ACK, 1+1+1
   struct in_addr *sid; //  DHCP: [54] Server Identifier = 157.54.48.151, 1+1+N
+
+  // Inline storage filled by parse_options; the pointers above refer to
+  // these fields instead of the heap when that parser is used.
+  struct in_addr request_val;
+  uint32_t lease_val;
+  uint8_t type_val;
+  struct in_addr sid_val;
 } options_t;
 //  DHCP: [255] End (no data)
 
@@ -104,6 +111,12 @@ void dump_packet(uint8_t *, size_t);
 void free_options (options_t *options);
 bool get_options (uint8_t *packet, uint8_t *end, options_t *options);
 
+// Allocation-free variant of get_options: option values are copied into
+// the inline fields of options and the pointers refer to them, so the
+// result lives exactly as long as the options_t itself (do not copy it by
+// value and expect the pointers to follow). free_options is optional.
+bool parse_options (uint8_t *packet, uint8_t *end, options_t *options);
+
 // Utility functions to append a DHCP cookie and a single DHCP option to the
 // end of the packet. In both cases, packet_size is the current length of
 // the array and packet points at the start of it. To set an option (e.g.,
@@ -115,4 +128,16 @@ uint8_t *append_cookie (uint8_t *packet, size_t *packet_size);
 uint8_t *append_option (uint8_t *packet, size_t *packet_size, uint8_t option,
 		uint8_t option_size, uint8_t *option_value);
 
+// Fixed-buffer versions of the above: the cookie or option is written in
+// place at packet + *packet_size, where packet has room for capacity
+// bytes. Nothing is allocated. If the write would overflow capacity, the
+// packet is left untouched and false is returned. For example:
+//    uint8_t packet[MAX_DHCP_LENGTH];
+//    size_t size = sizeof (msg_t);
+//    write_cookie (packet, &size, sizeof (packet));
+// The append_* functions above are wrappers that grow a heap packet first.
+bool write_cookie (uint8_t *packet, size_t *packet_size, size_t capacity);
+bool write_option (uint8_t *packet, size_t *packet_size, size_t capacity,
+		uint8_t option, uint8_t option_size, uint8_t *option_value);
+
 #endif
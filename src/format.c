@@ -103,7 +103,7 @@ dump_msg (FILE *output, msg_t *msg, size_t size)
   options_t options;
   memset (&options, 0, sizeof (options_t));
 
-  bool result = get_options (option_start, option_end, &options);
+  bool result = parse_options (option_start, option_end, &options);
   // printf("get_options returned %d\n", result);
 
   if (result)
@@ -138,7 +138,27 @@ dump_msg (FILE *output, msg_t *msg, size_t size)
           inet_ntop (AF_INET, options.sid, ipstr, INET_ADDRSTRLEN);
           fprintf (output, "Server Identifier = %s\n", ipstr);
         }
+    }
+}
+
+void
+dump_traffic (FILE *output, bool sent, msg_t *msg, size_t size)
+{
+  if (!sent)
+    {
+      fprintf (output, "++++++++++++++++++++++++++\n");
+      fprintf (output, "SERVER RECEIVED %d BYTES:\n", (int)size);
+      fprintf (output, "++++++++++++++++++++++++++\n\n");
+
+      dump_msg (output, msg, size);
+      fprintf (output, "\n");
+    }
+  else
+    {
+      fprintf (output, "+++++++++++++++++++++++++\n");
+      fprintf (output, "SERVER SENDING %ld BYTES:\n", (long)size);
+      fprintf (output, "+++++++++++++++++++++++++\n\n");
 
-      free_options (&options);
+      dump_msg (output, msg, size);
     }
 }
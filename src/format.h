@@ -1,9 +1,14 @@
 #ifndef __cs361_format__
 #define __cs361_format__
 
+#include <stdbool.h>
 #include <stdio.h>
 
 // Print the DHCP message to the specified output file stream
 void dump_msg (FILE *, msg_t *, size_t);
 
+// Print the server's banner for a received (sent == false) or sent
+// message followed by dump_msg, exactly as the server logs its traffic
+void dump_traffic (FILE *, bool sent, msg_t *, size_t);
+
 #endif
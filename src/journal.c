@@ -0,0 +1,314 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+struct journal
+{
+  int fd;
+  lease_db_t *db;
+  long interval_ms;
+  size_t batch;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work; // entries are waiting, or stopping
+  pthread_cond_t done; // durable moved forward
+  pthread_t tid;
+  bool stopping;
+
+  // entries appended but not yet handed to the flusher
+  struct journal_entry *pending;
+  size_t npending;
+  size_t allocated;
+  struct timespec oldest; // when the first pending entry was appended
+
+  uint64_t appended; // LSN of the last entry appended
+  uint64_t durable;  // LSN of the last entry on disk
+  size_t written;    // entries in the file since the last checkpoint
+};
+
+static uint32_t
+entry_checksum (const struct journal_entry *entry)
+{
+  // FNV-1a, as for the database records
+  const uint8_t *bytes = (const uint8_t *)entry;
+  size_t len = sizeof (struct journal_entry);
+  uint32_t h = 2166136261U;
+  for (size_t i = 0; i < len; i++)
+    {
+      if (i >= offsetof (struct journal_entry, checksum)
+          && i < offsetof (struct journal_entry, record))
+        continue;
+      h = (h ^ bytes[i]) * 16777619U;
+    }
+  return h;
+}
+
+long
+journal_replay (const char *path, lease_db_t *db)
+{
+  FILE *file = fopen (path, "rb");
+  if (file == NULL)
+    return errno == ENOENT ? 0 : -1;
+
+  struct lease_record *records = lease_db_records (db);
+  uint64_t after = lease_db_snapshot_lsn (db);
+  size_t capacity = lease_db_capacity (db);
+  long applied = 0;
+  struct journal_entry entry;
+  while (fread (&entry, sizeof (entry), 1, file) == 1)
+    {
+      if (entry.checksum != entry_checksum (&entry) || entry.slot >= capacity)
+        break;
+      if (entry.lsn <= after)
+        continue;
+      records[entry.slot] = entry.record;
+      after = entry.lsn;
+      applied++;
+    }
+
+  // the journal is started over from here on; keep the LSNs increasing
+  fclose (file);
+  if (!lease_db_checkpoint (db, after))
+    return -1;
+  return applied;
+}
+
+// Write the whole journal back into the database and empty the file.
+// Called with the lock held; everything appended so far has already been
+// stored into the mapped records. The lock is dropped during the msync,
+// so appenders (and the shard locks they run under) are not held up by
+// it; their entries stay pending and go to the emptied file.
+static void
+checkpoint (journal_t *journal)
+{
+  uint64_t lsn = journal->appended;
+  pthread_mutex_unlock (&journal->lock);
+  bool synced = lease_db_checkpoint (journal->db, lsn);
+  pthread_mutex_lock (&journal->lock);
+
+  // only the flusher, or journal_close once it is gone, writes the file
+  if (!synced || ftruncate (journal->fd, 0) < 0)
+    {
+      perror ("journal checkpoint");
+      return;
+    }
+  lseek (journal->fd, 0, SEEK_SET);
+  journal->written = 0;
+  if (lsn > journal->durable)
+    journal->durable = lsn;
+  pthread_cond_broadcast (&journal->done);
+}
+
+static bool
+flush_due (journal_t *journal, struct timespec *deadline)
+{
+  if (journal->npending >= journal->batch || journal->stopping)
+    return true;
+
+  *deadline = journal->oldest;
+  deadline->tv_sec += journal->interval_ms / 1000;
+  deadline->tv_nsec += (journal->interval_ms % 1000) * 1000000;
+  if (deadline->tv_nsec >= 1000000000)
+    {
+      deadline->tv_sec++;
+      deadline->tv_nsec -= 1000000000;
+    }
+
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return now.tv_sec > deadline->tv_sec
+         || (now.tv_sec == deadline->tv_sec
+             && now.tv_nsec >= deadline->tv_nsec);
+}
+
+// Group commit: take every pending entry, write them with one call and
+// make them durable with one fdatasync
+static void *
+flusher (void *arg)
+{
+  journal_t *journal = (journal_t *)arg;
+  struct journal_entry *spare = NULL;
+  size_t spare_allocated = 0;
+
+  pthread_mutex_lock (&journal->lock);
+  while (!journal->stopping || journal->npending > 0)
+    {
+      struct timespec deadline;
+      if (journal->npending == 0)
+        {
+          pthread_cond_wait (&journal->work, &journal->lock);
+          continue;
+        }
+      if (!flush_due (journal, &deadline))
+        {
+          pthread_cond_timedwait (&journal->work, &journal->lock, &deadline);
+          continue;
+        }
+
+      // swap buffers so appenders keep going during the write
+      struct journal_entry *group = journal->pending;
+      size_t count = journal->npending;
+      size_t group_allocated = journal->allocated;
+      uint64_t lsn = journal->appended;
+      journal->pending = spare;
+      journal->allocated = spare_allocated;
+      journal->npending = 0;
+      pthread_mutex_unlock (&journal->lock);
+
+      size_t len = count * sizeof (struct journal_entry);
+      const uint8_t *data = (const uint8_t *)group;
+      while (len > 0)
+        {
+          ssize_t n = write (journal->fd, data, len);
+          if (n < 0 && errno == EINTR)
+            continue;
+          if (n < 0)
+            {
+              perror ("journal write");
+              break;
+            }
+          data += n;
+          len -= n;
+        }
+      if (fdatasync (journal->fd) < 0)
+        perror ("journal fdatasync");
+      spare = group;
+      spare_allocated = group_allocated;
+
+      pthread_mutex_lock (&journal->lock);
+      if (lsn > journal->durable)
+        journal->durable = lsn;
+      journal->written += count;
+      pthread_cond_broadcast (&journal->done);
+      if (journal->written >= JOURNAL_COMPACT_ENTRIES)
+        checkpoint (journal);
+    }
+  pthread_mutex_unlock (&journal->lock);
+
+  free (spare);
+  return NULL;
+}
+
+journal_t *
+journal_open (const char *path, lease_db_t *db, long interval_ms, long batch)
+{
+  journal_t *journal = calloc (1, sizeof (journal_t));
+  if (journal == NULL)
+    return NULL;
+  journal->db = db;
+  journal->interval_ms = interval_ms;
+  journal->batch = batch > 0 ? batch : 1;
+  journal->appended = lease_db_snapshot_lsn (db);
+  journal->durable = journal->appended;
+
+  // the database already holds everything replayed from an old journal
+  journal->fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (journal->fd < 0 || fsync (journal->fd) < 0)
+    {
+      int saved = errno;
+      if (journal->fd >= 0)
+        close (journal->fd);
+      free (journal);
+      errno = saved;
+      return NULL;
+    }
+
+  pthread_mutex_init (&journal->lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&journal->work, &attr);
+  pthread_condattr_destroy (&attr);
+  pthread_cond_init (&journal->done, NULL);
+
+  int err = pthread_create (&journal->tid, NULL, flusher, journal);
+  if (err != 0)
+    {
+      close (journal->fd);
+      free (journal);
+      errno = err;
+      return NULL;
+    }
+  return journal;
+}
+
+uint64_t
+journal_append (journal_t *journal, uint32_t slot,
+                const struct lease_record *record)
+{
+  pthread_mutex_lock (&journal->lock);
+  if (journal->npending == journal->allocated)
+    {
+      size_t allocated = journal->allocated ? journal->allocated * 2 : 64;
+      struct journal_entry *pending = realloc (
+          journal->pending, allocated * sizeof (struct journal_entry));
+      if (pending == NULL)
+        {
+          // cannot queue it: leave it to the next checkpoint
+          uint64_t durable = journal->durable;
+          pthread_mutex_unlock (&journal->lock);
+          perror ("journal_append");
+          return durable;
+        }
+      journal->pending = pending;
+      journal->allocated = allocated;
+    }
+
+  struct journal_entry *entry = &journal->pending[journal->npending++];
+  memset (entry, 0, sizeof (struct journal_entry));
+  entry->lsn = ++journal->appended;
+  entry->slot = slot;
+  entry->record = *record;
+  entry->checksum = entry_checksum (entry);
+  uint64_t lsn = entry->lsn;
+
+  if (journal->npending == 1)
+    clock_gettime (CLOCK_MONOTONIC, &journal->oldest);
+  if (journal->npending == 1 || journal->npending >= journal->batch)
+    pthread_cond_signal (&journal->work);
+  pthread_mutex_unlock (&journal->lock);
+  return lsn;
+}
+
+void
+journal_wait (journal_t *journal, uint64_t lsn)
+{
+  if (journal == NULL)
+    return;
+  pthread_mutex_lock (&journal->lock);
+  while (journal->durable < lsn)
+    pthread_cond_wait (&journal->done, &journal->lock);
+  pthread_mutex_unlock (&journal->lock);
+}
+
+void
+journal_close (journal_t *journal)
+{
+  if (journal == NULL)
+    return;
+
+  pthread_mutex_lock (&journal->lock);
+  journal->stopping = true;
+  pthread_cond_signal (&journal->work);
+  pthread_mutex_unlock (&journal->lock);
+  pthread_join (journal->tid, NULL);
+
+  // nothing left to replay after an orderly shutdown
+  pthread_mutex_lock (&journal->lock);
+  checkpoint (journal);
+  pthread_mutex_unlock (&journal->lock);
+
+  close (journal->fd);
+  free (journal->pending);
+  pthread_mutex_destroy (&journal->lock);
+  pthread_cond_destroy (&journal->work);
+  pthread_cond_destroy (&journal->done);
+  free (journal);
+}
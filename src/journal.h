@@ -0,0 +1,58 @@
+#ifndef __cs361_journal_h__
+#define __cs361_journal_h__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "leasedb.h"
+
+// Write-ahead journal for the lease database (-j FILE). Every change to a
+// record is appended as a full copy of the record, tagged with its slot
+// and a log sequence number (LSN). A background thread writes appended
+// entries out and fdatasyncs them in groups: once COUNT entries are
+// waiting or the oldest has waited INTERVAL ms, whichever comes first.
+// Replies that promise a lease wait for their LSN to become durable.
+//
+// The database file is the snapshot the journal applies to. Once the
+// journal grows past JOURNAL_COMPACT_ENTRIES entries, the database is
+// msynced, stamped with the last LSN and the journal is truncated. Replay
+// applies every entry past the stamped LSN; since entries are complete
+// records, applying one whose change had already reached the database is
+// harmless.
+
+#define JOURNAL_COMPACT_ENTRIES 65536
+
+struct journal_entry
+{
+  uint64_t lsn;
+  uint32_t slot;
+  uint32_t checksum; // over lsn, slot and the record
+  struct lease_record record;
+};
+
+typedef struct journal journal_t;
+
+// Apply the entries of the journal at path that come after the database's
+// snapshot LSN to its records. A torn or corrupt entry ends the replay.
+// Returns the number of entries applied (0 if there is no journal), or -1
+// if the journal cannot be read.
+long journal_replay (const char *path, lease_db_t *db);
+
+// Truncate the journal at path and start the flushing thread. This
+// discards every entry in it, so call journal_replay on it first.
+// Returns NULL (with errno set) on failure.
+journal_t *journal_open (const char *path, lease_db_t *db, long interval_ms,
+                         long batch);
+
+// Append a copy of record for slot. Returns its LSN.
+uint64_t journal_append (journal_t *journal, uint32_t slot,
+                         const struct lease_record *record);
+
+// Block until every entry up to lsn is on disk
+void journal_wait (journal_t *journal, uint64_t lsn);
+
+// Flush and checkpoint everything, then stop the flushing thread
+void journal_close (journal_t *journal);
+
+#endif
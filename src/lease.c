@@ -0,0 +1,621 @@
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "arena.h"
+#include "journal.h"
+#include "lease.h"
+#include "leasedb.h"
+#include "timer.h"
+
+#define CACHE_LINE 64
+
+// Cold part of a lease: deadlines, only touched when its state changes
+struct lease_cold
+{
+  struct timer_node timer; // expiry deadline while active
+  uint32_t bound_until;    // end of the ACKed binding, 0 if none
+};
+
+// The store, its tables and all of their arrays are carved out of one
+// arena
+struct lease_store
+{
+  arena_t *arena;
+  struct lease *slots;     // hot, indexed by slot
+  struct lease_cold *cold; // same index
+  size_t capacity;
+  pool_t *pool; // addresses for new leases
+
+  // slots [next_fresh, capacity) have never been handed out; slots below
+  // it that hold no lease are chained through next from spare
+  pthread_mutex_t lock;
+  size_t next_fresh;
+  int32_t spare;
+
+  // persistent copy of every slot, or NULL; epoch is the wall-clock time
+  // of tick 0
+  struct lease_record *records;
+  uint32_t epoch;
+
+  // write-ahead journal of record changes, or NULL; slot i of this store
+  // is slot base + i of the journal
+  journal_t *journal;
+  uint32_t base;
+
+  lease_table_t **tables;
+  int ntables;
+};
+
+struct lease_table
+{
+  lease_store_t *store;
+  struct lease *slots;     // the store's
+  struct lease_cold *cold; // the store's
+
+  // hash index over (htype, hlen, chaddr) of every keyed slot it owns
+  int32_t *buckets;
+  size_t mask;
+
+  // one bit per slot currently holding one of its tombstones
+  uint64_t *tombstones;
+  size_t nwords;
+  size_t ntombstones;
+
+  // deadlines of its active leases
+  timer_wheel_t wheel;
+
+  uint64_t lsn; // last journal entry appended
+};
+
+// Client keys are chaddr as a fixed CHADDR_LEN-byte block with the bytes
+// past hlen zeroed, so comparing two keys is one 16-byte compare
+static void
+make_key (uint8_t key[CHADDR_LEN], uint8_t hlen, const uint8_t *chaddr)
+{
+  memset (key, 0, CHADDR_LEN);
+  memcpy (key, chaddr, hlen);
+}
+
+static bool
+key_equal (const uint8_t *a, const uint8_t *b)
+{
+#if defined(__SSE2__)
+  __m128i eq = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *)a),
+                               _mm_loadu_si128 ((const __m128i *)b));
+  return _mm_movemask_epi8 (eq) == 0xffff;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  return vminvq_u8 (vceqq_u8 (vld1q_u8 (a), vld1q_u8 (b))) == 0xff;
+#else
+  uint64_t x[2], y[2];
+  memcpy (x, a, CHADDR_LEN);
+  memcpy (y, b, CHADDR_LEN);
+  return ((x[0] ^ y[0]) | (x[1] ^ y[1])) == 0;
+#endif
+}
+
+// Multiply-mix the two halves of the key, then murmur3's 64-bit finalizer
+static uint32_t
+key_hash (uint8_t htype, uint8_t hlen, const uint8_t *key)
+{
+  uint64_t lo, hi;
+  memcpy (&lo, key, sizeof (lo));
+  memcpy (&hi, key + sizeof (lo), sizeof (hi));
+
+  uint64_t h = (lo ^ ((uint64_t)htype << 8 | hlen)) * 0x9e3779b97f4a7c15ULL;
+  h ^= (hi + 0x632be59bd9b4e019ULL) * 0xc2b2ae3d27d4eb4fULL;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return (uint32_t)h;
+}
+
+uint32_t
+lease_key_hash (uint8_t htype, uint8_t hlen, const uint8_t *chaddr)
+{
+  if (hlen > CHADDR_LEN)
+    hlen = CHADDR_LEN;
+
+  uint8_t key[CHADDR_LEN];
+  make_key (key, hlen, chaddr);
+  return key_hash (htype, hlen, key);
+}
+
+static bool
+same_key (const struct lease *lease, uint8_t htype, uint8_t hlen,
+          const uint8_t *key)
+{
+  return lease->htype == htype && lease->hlen == hlen
+         && key_equal (lease->chaddr, key);
+}
+
+static void
+index_insert (lease_table_t *table, int32_t idx)
+{
+  struct lease *lease = &table->slots[idx];
+  size_t b = key_hash (lease->htype, lease->hlen, lease->chaddr) & table->mask;
+  lease->next = table->buckets[b];
+  table->buckets[b] = idx;
+}
+
+static void
+index_remove (lease_table_t *table, int32_t idx)
+{
+  struct lease *lease = &table->slots[idx];
+  size_t b = key_hash (lease->htype, lease->hlen, lease->chaddr) & table->mask;
+  int32_t *link = &table->buckets[b];
+  while (*link != -1)
+    {
+      if (*link == idx)
+        {
+          *link = lease->next;
+          break;
+        }
+      link = &table->slots[*link].next;
+    }
+  lease->next = -1;
+}
+
+static void
+tombstone_set (lease_table_t *table, size_t idx, bool on)
+{
+  uint64_t bit = 1ULL << (idx % 64);
+  if (on)
+    {
+      table->tombstones[idx / 64] |= bit;
+      table->ntombstones++;
+    }
+  else
+    {
+      table->tombstones[idx / 64] &= ~bit;
+      table->ntombstones--;
+    }
+}
+
+static int32_t
+tombstone_first (lease_table_t *table)
+{
+  if (table->ntombstones == 0)
+    return -1;
+  for (size_t w = 0; w < table->nwords; w++)
+    {
+      if (table->tombstones[w] != 0)
+        return (int32_t)(w * 64 + __builtin_ctzll (table->tombstones[w]));
+    }
+  return -1;
+}
+
+// Store a lease's current state into its record
+static void
+persist (lease_table_t *table, struct lease *lease)
+{
+  lease_store_t *store = table->store;
+  if (store->records == NULL)
+    return;
+
+  size_t idx = lease - table->slots;
+  struct lease_cold *cold = &table->cold[idx];
+  struct lease_record record;
+  memset (&record, 0, sizeof (record));
+  record.state = lease->state;
+  record.htype = lease->htype;
+  record.hlen = lease->hlen;
+  memcpy (record.chaddr, lease->chaddr, CHADDR_LEN);
+  record.ip = lease->ip.s_addr;
+  if (timer_pending (&cold->timer))
+    record.expires = store->epoch + cold->timer.expires;
+  if (cold->bound_until != 0)
+    record.bound_until = store->epoch + cold->bound_until;
+  record.checksum = lease_record_checksum (&record);
+
+  store->records[idx] = record;
+  if (store->journal != NULL)
+    table->lsn = journal_append (store->journal, store->base + idx, &record);
+}
+
+// Convert a wall-clock time from a record to a tick; past times become 0
+static uint32_t
+to_tick (lease_store_t *store, uint32_t when)
+{
+  return when > store->epoch ? when - store->epoch : 0;
+}
+
+lease_store_t *
+lease_store_create (size_t capacity, pool_t *pool, int ntables)
+{
+  if (capacity == 0 || capacity > INT32_MAX || ntables < 1)
+    return NULL;
+
+  // a table's index is sized for its share of the slots; one that ends
+  // up with more only gets longer chains
+  size_t share = (capacity + ntables - 1) / ntables;
+  size_t nbuckets = 1;
+  while (nbuckets < share * 2)
+    nbuckets <<= 1;
+  size_t nwords = (capacity + 63) / 64;
+
+  // one mapping for everything, each array on its own cache lines
+  size_t per_table = sizeof (lease_table_t *) + sizeof (lease_table_t)
+                     + nbuckets * sizeof (int32_t)
+                     + nwords * sizeof (uint64_t) + 3 * CACHE_LINE;
+  size_t size = sizeof (lease_store_t) + capacity * sizeof (struct lease)
+                + capacity * sizeof (struct lease_cold) + ntables * per_table
+                + 4 * CACHE_LINE;
+  arena_t *arena = arena_create (size);
+  if (arena == NULL)
+    return NULL;
+
+  lease_store_t *store = arena_alloc (arena, sizeof (lease_store_t),
+                                      CACHE_LINE);
+  store->arena = arena;
+  store->capacity = capacity;
+  store->pool = pool;
+  pthread_mutex_init (&store->lock, NULL);
+  store->spare = -1;
+  store->slots
+      = arena_alloc (arena, capacity * sizeof (struct lease), CACHE_LINE);
+  store->cold
+      = arena_alloc (arena, capacity * sizeof (struct lease_cold), CACHE_LINE);
+  store->tables
+      = arena_alloc (arena, ntables * sizeof (lease_table_t *), CACHE_LINE);
+  store->ntables = ntables;
+
+  // arena memory is zeroed: every slot is LEASE_EMPTY and every timer
+  // unscheduled; only the chain links need setting
+  for (size_t i = 0; i < capacity; i++)
+    store->slots[i].next = -1;
+
+  for (int t = 0; t < ntables; t++)
+    {
+      lease_table_t *table = arena_alloc (arena, sizeof (lease_table_t),
+                                          CACHE_LINE);
+      table->store = store;
+      table->slots = store->slots;
+      table->cold = store->cold;
+      table->mask = nbuckets - 1;
+      table->nwords = nwords;
+      table->buckets
+          = arena_alloc (arena, nbuckets * sizeof (int32_t), CACHE_LINE);
+      table->tombstones
+          = arena_alloc (arena, nwords * sizeof (uint64_t), CACHE_LINE);
+      memset (table->buckets, 0xff, nbuckets * sizeof (int32_t));
+      timer_wheel_init (&table->wheel, 0);
+      store->tables[t] = table;
+    }
+
+  return store;
+}
+
+void
+lease_store_destroy (lease_store_t *store)
+{
+  if (store == NULL)
+    return;
+  pthread_mutex_destroy (&store->lock);
+  arena_destroy (store->arena);
+}
+
+lease_table_t *
+lease_store_table (lease_store_t *store, int i)
+{
+  return store->tables[i];
+}
+
+int
+lease_store_pick (lease_store_t *store, uint8_t htype, uint8_t hlen,
+                  const uint8_t *chaddr)
+{
+  uint32_t h = lease_key_hash (htype, hlen, chaddr);
+  // use the high bits; the tables' bucket index uses the low ones
+  return (int)(((uint64_t)h * store->ntables) >> 32);
+}
+
+lease_table_t *
+lease_table_create (size_t capacity, pool_t *pool)
+{
+  lease_store_t *store = lease_store_create (capacity, pool, 1);
+  return store != NULL ? store->tables[0] : NULL;
+}
+
+void
+lease_table_destroy (lease_table_t *table)
+{
+  if (table != NULL)
+    lease_store_destroy (table->store);
+}
+
+// Take an empty slot of the store with the pool's lowest available
+// address; false if either has run out
+static bool
+take_slot (lease_store_t *store, int32_t *idx, struct in_addr *ip)
+{
+  pthread_mutex_lock (&store->lock);
+  bool found = (store->spare != -1 || store->next_fresh < store->capacity)
+               && pool_alloc (store->pool, ip);
+  if (found && store->spare != -1)
+    {
+      *idx = store->spare;
+      store->spare = store->slots[*idx].next;
+      store->slots[*idx].next = -1;
+    }
+  else if (found)
+    *idx = (int32_t)store->next_fresh++;
+  pthread_mutex_unlock (&store->lock);
+  return found;
+}
+
+// Hand an emptied slot back to the store, for any table to take
+static void
+give_slot (lease_store_t *store, int32_t idx)
+{
+  pthread_mutex_lock (&store->lock);
+  store->slots[idx].next = store->spare;
+  store->spare = idx;
+  pthread_mutex_unlock (&store->lock);
+}
+
+struct lease *
+lease_lookup (lease_table_t *table, uint8_t htype, uint8_t hlen,
+              const uint8_t *chaddr)
+{
+  if (hlen > CHADDR_LEN)
+    hlen = CHADDR_LEN;
+
+  uint8_t key[CHADDR_LEN];
+  make_key (key, hlen, chaddr);
+  size_t b = key_hash (htype, hlen, key) & table->mask;
+  for (int32_t i = table->buckets[b]; i != -1; i = table->slots[i].next)
+    {
+      if (same_key (&table->slots[i], htype, hlen, key))
+        return &table->slots[i];
+    }
+
+  return NULL;
+}
+
+struct lease *
+lease_find (lease_table_t *table, uint8_t htype, uint8_t hlen,
+            const uint8_t *chaddr)
+{
+  struct lease *lease = lease_lookup (table, htype, hlen, chaddr);
+  if (lease != NULL && lease->state >= LEASE_OFFERED)
+    return lease;
+  return NULL;
+}
+
+struct lease *
+lease_assign (lease_table_t *table, uint8_t htype, uint8_t hlen,
+              const uint8_t *chaddr)
+{
+  if (hlen > CHADDR_LEN)
+    hlen = CHADDR_LEN;
+
+  // 1. Reuse existing active lease for this chaddr
+  // 2. Reuse a tombstone for this chaddr (released, remembers IP)
+  struct lease *lease = lease_lookup (table, htype, hlen, chaddr);
+  if (lease != NULL)
+    {
+      if (lease->state == LEASE_RELEASED)
+        {
+          tombstone_set (table, lease - table->slots, false);
+          lease->state = LEASE_RESERVED;
+        }
+      return lease;
+    }
+
+  int32_t idx;
+  struct in_addr ip;
+  if (take_slot (table->store, &idx, &ip))
+    {
+      // 3. Brand-new lease: an empty slot and the lowest unused address
+      lease = &table->slots[idx];
+      lease->ip = ip;
+    }
+  else
+    {
+      // 4. No new slots or IPs left: reuse the lowest released lease
+      idx = tombstone_first (table);
+      if (idx < 0)
+        return NULL; // 5. Completely out of space
+      tombstone_set (table, idx, false);
+      index_remove (table, idx);
+      lease = &table->slots[idx];
+    }
+
+  lease->state = LEASE_RESERVED;
+  lease->htype = htype;
+  lease->hlen = hlen;
+  make_key (lease->chaddr, hlen, chaddr);
+  index_insert (table, idx);
+
+  return lease;
+}
+
+void
+lease_release (lease_table_t *table, struct lease *lease)
+{
+  if (lease->state < LEASE_OFFERED)
+    return;
+  size_t idx = lease - table->slots;
+  lease->state = LEASE_RELEASED;
+  table->cold[idx].bound_until = 0;
+  timer_cancel (&table->cold[idx].timer);
+  tombstone_set (table, idx, true);
+  persist (table, lease);
+}
+
+bool
+lease_reclaim (lease_table_t *table)
+{
+  int32_t idx = tombstone_first (table);
+  if (idx < 0)
+    return false;
+  tombstone_set (table, idx, false);
+  index_remove (table, idx);
+
+  // the empty record is stored before another table can take the slot
+  struct lease *lease = &table->slots[idx];
+  pool_free (table->store->pool, lease->ip);
+  memset (lease, 0, sizeof (struct lease));
+  persist (table, lease);
+  give_slot (table->store, idx);
+  return true;
+}
+
+void
+lease_offer (lease_table_t *table, struct lease *lease, uint64_t expires)
+{
+  struct lease_cold *cold = &table->cold[lease - table->slots];
+  if (cold->bound_until > expires)
+    expires = cold->bound_until;
+  lease->state = LEASE_OFFERED;
+  lease_set_expiry (table, lease, expires);
+}
+
+void
+lease_bind (lease_table_t *table, struct lease *lease, uint64_t until)
+{
+  table->cold[lease - table->slots].bound_until = until;
+  lease->state = LEASE_BOUND;
+  lease_set_expiry (table, lease, until);
+}
+
+void
+lease_withdraw (lease_table_t *table, struct lease *lease)
+{
+  if (lease->state != LEASE_OFFERED)
+    return;
+  lease->state = LEASE_RESERVED;
+  persist (table, lease);
+}
+
+void
+lease_set_expiry (lease_table_t *table, struct lease *lease, uint64_t when)
+{
+  timer_schedule (&table->wheel, &table->cold[lease - table->slots].timer,
+                  when);
+  persist (table, lease);
+}
+
+void
+lease_store_journal (lease_store_t *store, journal_t *journal, uint32_t base)
+{
+  store->journal = journal;
+  store->base = base;
+}
+
+void
+lease_table_journal (lease_table_t *table, journal_t *journal, uint32_t base)
+{
+  lease_store_journal (table->store, journal, base);
+}
+
+uint64_t
+lease_table_lsn (lease_table_t *table)
+{
+  return table->lsn;
+}
+
+size_t
+lease_store_attach (lease_store_t *store, struct lease_record *records,
+                    uint32_t epoch)
+{
+  store->records = records;
+  store->epoch = epoch;
+
+  // everything past the last record in use was never handed out
+  size_t top = store->capacity;
+  while (top > 0 && records[top - 1].state == LEASE_EMPTY
+         && records[top - 1].checksum == 0)
+    top--;
+  store->next_fresh = top;
+
+  size_t restored = 0;
+  for (size_t i = top; i-- > 0;)
+    {
+      struct lease_record *record = &records[i];
+      struct lease *lease = &store->slots[i];
+      lease->ip.s_addr = record->ip;
+
+      // a torn or unused record below top, or one whose address is no
+      // longer in the pool, leaves an empty slot
+      if (record->checksum != lease_record_checksum (record)
+          || record->state == LEASE_EMPTY || record->state > LEASE_RESERVED
+          || record->hlen > CHADDR_LEN
+          || !pool_reserve (store->pool, lease->ip))
+        {
+          memset (record, 0, sizeof (struct lease_record));
+          lease->ip.s_addr = 0;
+          lease->next = store->spare;
+          store->spare = i;
+          continue;
+        }
+
+      lease->htype = record->htype;
+      lease->hlen = record->hlen;
+      make_key (lease->chaddr, lease->hlen, record->chaddr);
+      lease_table_t *table = store->tables[lease_store_pick (
+          store, lease->htype, lease->hlen, lease->chaddr)];
+      index_insert (table, i); // hlen 0 is a key too, as in lease_assign
+      if (record->state == LEASE_RELEASED)
+        {
+          lease->state = LEASE_RELEASED;
+          tombstone_set (table, i, true);
+          continue;
+        }
+
+      // deadlines that passed while the server was down fire on the
+      // first lease_expire
+      lease->state = record->state;
+      if (record->bound_until != 0)
+        store->cold[i].bound_until = to_tick (store, record->bound_until);
+      if (record->expires != 0)
+        timer_schedule (&table->wheel, &store->cold[i].timer,
+                        to_tick (store, record->expires));
+      restored++;
+    }
+
+  return restored;
+}
+
+size_t
+lease_table_attach (lease_table_t *table, struct lease_record *records,
+                    uint32_t epoch)
+{
+  return lease_store_attach (table->store, records, epoch);
+}
+
+struct expiry
+{
+  lease_table_t *table;
+  size_t released;
+};
+
+static void
+expire_one (struct timer_node *node, void *arg)
+{
+  struct expiry *expiry = (struct expiry *)arg;
+  lease_table_t *table = expiry->table;
+  size_t offset = offsetof (struct lease_cold, timer);
+  struct lease_cold *cold = (struct lease_cold *)((uint8_t *)node - offset);
+  lease_release (table, &table->slots[cold - table->cold]);
+  expiry->released++;
+}
+
+size_t
+lease_expire (lease_table_t *table, uint64_t now)
+{
+  struct expiry expiry = { table, 0 };
+  timer_advance (&table->wheel, now, expire_one, &expiry);
+  return expiry.released;
+}
@@ -0,0 +1,139 @@
+#ifndef __cs361_lease_h__
+#define __cs361_lease_h__
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+#define CHADDR_LEN 16
+
+// Lease states, packed into one byte (and stored as is in leasedb.h)
+enum lease_state
+{
+  LEASE_EMPTY,    // slot holds no lease
+  LEASE_RELEASED, // tombstone: keeps chaddr and IP for the same client
+  LEASE_OFFERED,  // offered, waiting for a REQUEST
+  LEASE_BOUND,    // ACKed
+  LEASE_RESERVED, // held for its client, but not offered or bound
+};
+
+// A lease is active in any state from LEASE_OFFERED on. The table keeps
+// what a lookup touches (state, key, chain link and address) in this
+// 32-byte record, two to a cache line; deadlines live in a separate cold
+// array.
+struct lease
+{
+  uint8_t state; // enum lease_state
+  uint8_t htype;
+  uint8_t hlen;
+  int32_t next; // next slot in the same hash bucket, -1 ends
+  uint8_t chaddr[CHADDR_LEN]; // zero past hlen
+  struct in_addr ip;
+} __attribute__ ((aligned (32)));
+
+// A store holds the slots of one subnet. They are indexed by one or more
+// tables, each serving the clients whose key lease_store_pick maps to it,
+// so that the tables can be used by different threads at once. A slot
+// belongs to one table from when it is handed out until it is empty
+// again; only handing empty slots out and taking them back is locked
+// within the store. Every other call on a table must be serialized by its
+// caller.
+typedef struct lease_store lease_store_t;
+typedef struct lease_table lease_table_t;
+struct journal;
+struct lease_record;
+
+// Hash of a client key, as used by the table's index
+uint32_t lease_key_hash (uint8_t htype, uint8_t hlen, const uint8_t *chaddr);
+
+// Create a store of capacity slots split over ntables tables, whose new
+// leases take addresses from pool. The pool is not owned by the store.
+lease_store_t *lease_store_create (size_t capacity, pool_t *pool,
+                                   int ntables);
+void lease_store_destroy (lease_store_t *store);
+
+// Table i of a store, for 0 <= i < ntables
+lease_table_t *lease_store_table (lease_store_t *store, int i);
+
+// The table of a store that serves a client
+int lease_store_pick (lease_store_t *store, uint8_t htype, uint8_t hlen,
+                      const uint8_t *chaddr);
+
+// A store with a single table of capacity slots, destroyed along with the
+// table
+lease_table_t *lease_table_create (size_t capacity, pool_t *pool);
+void lease_table_destroy (lease_table_t *table);
+
+// Look up the record (active or tombstone) for a client, or NULL
+struct lease *lease_lookup (lease_table_t *table, uint8_t htype, uint8_t hlen,
+                            const uint8_t *chaddr);
+
+// Look up the active lease for a client, or NULL
+struct lease *lease_find (lease_table_t *table, uint8_t htype, uint8_t hlen,
+                          const uint8_t *chaddr);
+
+// Find or allocate an active lease for a client. In order of preference:
+// the client's active lease, the client's tombstone, an empty slot of
+// the store with the pool's lowest available address and finally the
+// table's lowest released slot of some other client. Returns NULL once
+// none is left; other tables' tombstones are taken with lease_reclaim.
+struct lease *lease_assign (lease_table_t *table, uint8_t htype, uint8_t hlen,
+                            const uint8_t *chaddr);
+
+// Turn an active lease into a tombstone
+void lease_release (lease_table_t *table, struct lease *lease);
+
+// Empty the lowest tombstone, handing its slot back to the store and its
+// address back to the pool, so that another table of the store can use
+// them. Returns false if the table holds no tombstone.
+bool lease_reclaim (lease_table_t *table);
+
+// Deadlines are in whole seconds on the caller's clock, which starts at 0
+// when the table is created and never goes backwards.
+
+// Offer an active lease until expires, or until its current binding ends
+// if that is later
+void lease_offer (lease_table_t *table, struct lease *lease,
+                  uint64_t expires);
+
+// Bind an offered lease until until
+void lease_bind (lease_table_t *table, struct lease *lease, uint64_t until);
+
+// Take back an unanswered offer; the lease stays reserved for its client
+// until its deadline
+void lease_withdraw (lease_table_t *table, struct lease *lease);
+
+// (Re)arm the deadline at which an active lease is released
+void lease_set_expiry (lease_table_t *table, struct lease *lease,
+                       uint64_t when);
+
+// Release every active lease whose deadline is at or before now. Returns
+// the number of leases released.
+size_t lease_expire (lease_table_t *table, uint64_t now);
+
+// Back a new store with capacity persistent records (see leasedb.h) and
+// load the leases they hold, each into the table that serves its client;
+// records are in wall-clock seconds and epoch is the wall-clock time of
+// tick 0. Returns the number of active leases restored. From then on a
+// lease's record is updated whenever its state or deadline changes.
+size_t lease_store_attach (lease_store_t *store, struct lease_record *records,
+                           uint32_t epoch);
+
+// Also append every record change to journal (see journal.h), where the
+// store's records start at slot base
+void lease_store_journal (lease_store_t *store, struct journal *journal,
+                          uint32_t base);
+
+// The same for the store of a table from lease_table_create
+size_t lease_table_attach (lease_table_t *table, struct lease_record *records,
+                           uint32_t epoch);
+void lease_table_journal (lease_table_t *table, struct journal *journal,
+                          uint32_t base);
+
+// LSN of the last change this table journaled (0 if none)
+uint64_t lease_table_lsn (lease_table_t *table);
+
+#endif
@@ -0,0 +1,210 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "leasedb.h"
+
+struct lease_db
+{
+  int fd;
+  struct lease_db_header *header;
+  size_t size;
+  bool recovered;
+};
+
+// FNV-1a over the bytes of a header or record
+static uint32_t
+checksum (const void *data, size_t len)
+{
+  const uint8_t *bytes = data;
+  uint32_t h = 2166136261U;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ bytes[i]) * 16777619U;
+  return h;
+}
+
+static uint32_t
+header_checksum (const struct lease_db_header *header)
+{
+  return checksum (header, offsetof (struct lease_db_header, checksum));
+}
+
+uint32_t
+lease_record_checksum (const struct lease_record *record)
+{
+  return checksum (record, offsetof (struct lease_record, checksum));
+}
+
+static bool
+header_matches (const struct lease_db_header *header, size_t capacity,
+                int nsubnets, struct in_addr first_ip)
+{
+  return memcmp (header->magic, LEASE_DB_MAGIC, sizeof (header->magic)) == 0
+         && header->version == LEASE_DB_VERSION
+         && header->record_size == sizeof (struct lease_record)
+         && header->capacity == capacity && header->nsubnets == nsubnets
+         && header->first_ip == first_ip.s_addr
+         && header->checksum == header_checksum (header);
+}
+
+// Explain why the existing file at path cannot be used as it is
+static void
+report_mismatch (const char *path, const struct lease_db_header *header,
+                 size_t capacity, int nsubnets, struct in_addr first_ip)
+{
+  if (memcmp (header->magic, LEASE_DB_MAGIC, sizeof (header->magic)) != 0
+      || header->checksum != header_checksum (header))
+    {
+      fprintf (stderr, "%s: not a lease database\n", path);
+      return;
+    }
+  if (header->version != LEASE_DB_VERSION
+      || header->record_size != sizeof (struct lease_record))
+    {
+      fprintf (stderr, "%s: lease database version %u, expected %u\n", path,
+               header->version, LEASE_DB_VERSION);
+      return;
+    }
+
+  char had[INET_ADDRSTRLEN], want[INET_ADDRSTRLEN];
+  struct in_addr old_ip = { header->first_ip };
+  inet_ntop (AF_INET, &old_ip, had, sizeof (had));
+  inet_ntop (AF_INET, &first_ip, want, sizeof (want));
+  fprintf (stderr,
+           "%s: lease database holds %u records in %u subnet(s) from %s, "
+           "but this configuration needs %zu in %d from %s; restart with "
+           "the same -c, -n and -g options, or move the file away to "
+           "start over\n",
+           path, header->capacity, header->nsubnets, had, capacity, nsubnets,
+           want);
+}
+
+lease_db_t *
+lease_db_open (const char *path, size_t capacity, int nsubnets,
+               struct in_addr first_ip)
+{
+  lease_db_t *db = calloc (1, sizeof (lease_db_t));
+  if (db == NULL)
+    return NULL;
+  db->size = sizeof (struct lease_db_header)
+             + capacity * sizeof (struct lease_record);
+
+  db->fd = open (path, O_RDWR | O_CREAT, 0644);
+  struct stat st;
+  if (db->fd < 0 || fstat (db->fd, &st) < 0)
+    goto fail;
+
+  // only an empty file is set up from scratch; the bindings in any
+  // other one are never thrown away
+  bool fresh = st.st_size == 0;
+  if (!fresh)
+    {
+      struct lease_db_header header;
+      memset (&header, 0, sizeof (header));
+      if (pread (db->fd, &header, sizeof (header), 0) < 0)
+        goto fail;
+      if ((size_t)st.st_size != db->size
+          || !header_matches (&header, capacity, nsubnets, first_ip))
+        {
+          report_mismatch (path, &header, capacity, nsubnets, first_ip);
+          errno = EINVAL;
+          goto fail;
+        }
+    }
+  else if (ftruncate (db->fd, db->size) < 0)
+    goto fail;
+
+  db->header = mmap (NULL, db->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     db->fd, 0);
+  if (db->header == MAP_FAILED)
+    {
+      db->header = NULL;
+      goto fail;
+    }
+
+  struct lease_db_header *header = db->header;
+  if (fresh)
+    {
+      memcpy (header->magic, LEASE_DB_MAGIC, sizeof (header->magic));
+      header->version = LEASE_DB_VERSION;
+      header->record_size = sizeof (struct lease_record);
+      header->capacity = capacity;
+      header->nsubnets = nsubnets;
+      header->first_ip = first_ip.s_addr;
+      header->checksum = header_checksum (header);
+    }
+  else
+    db->recovered = !header->clean;
+
+  // the clean mark must reach the disk before any record changes
+  header->clean = 0;
+  if (msync (db->header, sizeof (struct lease_db_header), MS_SYNC) < 0)
+    goto fail;
+
+  return db;
+
+fail:;
+  int saved = errno;
+  if (db->header != NULL)
+    munmap (db->header, db->size);
+  if (db->fd >= 0)
+    close (db->fd);
+  free (db);
+  errno = saved;
+  return NULL;
+}
+
+struct lease_record *
+lease_db_records (lease_db_t *db)
+{
+  return (struct lease_record *)(db->header + 1);
+}
+
+size_t
+lease_db_capacity (lease_db_t *db)
+{
+  return db->header->capacity;
+}
+
+bool
+lease_db_recovered (lease_db_t *db)
+{
+  return db->recovered;
+}
+
+bool
+lease_db_checkpoint (lease_db_t *db, uint64_t lsn)
+{
+  if (msync (db->header, db->size, MS_SYNC) < 0)
+    return false;
+  db->header->snapshot_lsn = lsn;
+  return msync (db->header, sizeof (struct lease_db_header), MS_SYNC) == 0;
+}
+
+uint64_t
+lease_db_snapshot_lsn (lease_db_t *db)
+{
+  return db->header->snapshot_lsn;
+}
+
+void
+lease_db_close (lease_db_t *db)
+{
+  if (db == NULL)
+    return;
+
+  // records first, then the clean mark on its own
+  msync (db->header, db->size, MS_SYNC);
+  db->header->clean = 1;
+  msync (db->header, sizeof (struct lease_db_header), MS_SYNC);
+
+  munmap (db->header, db->size);
+  close (db->fd);
+  free (db);
+}
@@ -0,0 +1,81 @@
+#ifndef __cs361_leasedb_h__
+#define __cs361_leasedb_h__
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Persistent lease database (-f FILE). The file is a fixed-size header
+// followed by one record per lease slot. It is mapped MAP_SHARED and the
+// lease tables store into their records as leases change, so a restart
+// only maps the file and rebuilds the in-memory index from it.
+//
+// Crash consistency: stores land in the page cache, which outlives a
+// crashed process, and the kernel writes them back on its own schedule;
+// an orderly shutdown msyncs and marks the file clean. A record has its
+// own checksum, so one that was torn by a power loss is detected; its
+// slot is emptied and its address goes back to the pool. A file whose
+// version or geometry does not match is refused, never overwritten.
+
+#define LEASE_DB_MAGIC "DHCPLDB"
+#define LEASE_DB_VERSION 3
+
+struct lease_db_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t capacity;     // number of records
+  uint32_t nsubnets;     // lease stores sharing the records, in order
+  uint32_t first_ip;     // start of the address pool, network byte order
+  uint32_t checksum;     // over every field above
+  uint32_t clean;        // 1 after an orderly shutdown, 0 while in use
+  uint32_t reserved0;
+  uint64_t snapshot_lsn; // last journal entry included (see journal.h)
+  uint8_t reserved[16];
+};
+
+// Times are wall-clock seconds; 0 means none
+struct lease_record
+{
+  uint8_t state; // enum lease_state (see lease.h)
+  uint8_t htype;
+  uint8_t hlen;
+  uint8_t reserved;
+  uint8_t chaddr[16];
+  uint32_t ip;          // network byte order
+  uint32_t expires;     // deadline of the current state
+  uint32_t bound_until; // end of the ACKed binding
+  uint32_t checksum;    // over every field above
+};
+
+typedef struct lease_db lease_db_t;
+
+// Map the database at path, creating it if it is missing or empty.
+// Returns NULL (with errno set) on failure; a file made for another
+// geometry is left alone, with errno EINVAL and the mismatch explained
+// on stderr.
+lease_db_t *lease_db_open (const char *path, size_t capacity,
+                           int nsubnets, struct in_addr first_ip);
+
+// The mapped records; capacity of them
+struct lease_record *lease_db_records (lease_db_t *db);
+
+size_t lease_db_capacity (lease_db_t *db);
+
+// True if the previous run did not shut down cleanly
+bool lease_db_recovered (lease_db_t *db);
+
+// Write every record to disk, then record that they include all journal
+// entries up to lsn. Returns false if the records could not be synced.
+bool lease_db_checkpoint (lease_db_t *db, uint64_t lsn);
+
+uint64_t lease_db_snapshot_lsn (lease_db_t *db);
+
+uint32_t lease_record_checksum (const struct lease_record *record);
+
+// Write everything back to disk, mark the file clean and unmap it
+void lease_db_close (lease_db_t *db);
+
+#endif
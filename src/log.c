@@ -0,0 +1,254 @@
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dhcp.h"
+#include "format.h"
+#include "log.h"
+#include "metrics.h"
+#include "pcap.h"
+#include "server.h"
+
+// One queued packet. seq implements a bounded multi-producer queue: a slot
+// is free for the producer claiming position pos when seq == pos, and
+// holds data for the consumer when seq == pos + 1.
+struct log_slot
+{
+  uint8_t data[MAX_DHCP_LENGTH] __attribute__ ((aligned (8)));
+  size_t seq;
+  uint16_t size;
+  uint8_t direction;
+  struct timespec when;
+  struct sockaddr_in peer;
+};
+
+static struct log_slot *ring = NULL;
+static size_t mask = 0;
+static size_t tail = 0; // next position producers claim
+static size_t head = 0; // next position the consumer reads
+
+static int level = LOG_PACKETS;
+static FILE *capture = NULL;
+static uint16_t port = 0;
+static bool running = false;
+static bool done = false;
+static size_t dropped = 0;
+static pthread_t thread;
+
+// Set by the logging thread before it blocks on an empty ring; whoever
+// clears it (a producer that just published, or log_stop) wakes it. An
+// idle server's logging thread thus sleeps until there is work.
+static uint32_t sleeping = 0;
+
+static void
+wake_consumer (void)
+{
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&sleeping, __ATOMIC_RELAXED)
+      && __atomic_exchange_n (&sleeping, 0, __ATOMIC_RELAXED))
+    syscall (SYS_futex, &sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Block until a producer publishes a packet or log_stop is called
+static void
+wait_producers (void)
+{
+  __atomic_store_n (&sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  // recheck after announcing the sleep, or a wakeup could be missed
+  size_t seq = __atomic_load_n (&ring[head & mask].seq, __ATOMIC_ACQUIRE);
+  if (seq == head + 1 || __atomic_load_n (&done, __ATOMIC_ACQUIRE))
+    {
+      __atomic_store_n (&sleeping, 0, __ATOMIC_RELAXED);
+      return;
+    }
+  syscall (SYS_futex, &sleeping, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+  __atomic_store_n (&sleeping, 0, __ATOMIC_RELAXED);
+}
+
+static void
+log_close_capture (void)
+{
+  if (capture != NULL)
+    fclose (capture);
+  capture = NULL;
+}
+
+static void
+format_packet (struct log_slot *slot)
+{
+  bool sent = slot->direction == LOG_SENT;
+  if (level >= LOG_PACKETS)
+    dump_traffic (stdout, sent, (msg_t *)slot->data, slot->size);
+  if (capture != NULL)
+    pcap_write (capture, sent, &slot->when, &slot->peer, port, slot->data,
+                slot->size);
+}
+
+static void
+flush_output (void)
+{
+  if (level >= LOG_PACKETS)
+    fflush (stdout);
+  if (capture != NULL)
+    fflush (capture);
+}
+
+// Format one queued packet if there is one. Only the logging thread
+// consumes, so head needs no atomics.
+static bool
+drain_one (void)
+{
+  struct log_slot *slot = &ring[head & mask];
+  size_t seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+  if (seq != head + 1)
+    return false;
+
+  format_packet (slot);
+  __atomic_store_n (&slot->seq, head + mask + 1, __ATOMIC_RELEASE);
+  head++;
+  return true;
+}
+
+static void *
+log_thread (void *arg)
+{
+  (void)arg;
+
+  while (1)
+    {
+      bool any = false;
+      while (drain_one ())
+        any = true;
+      if (any)
+        flush_output ();
+      else if (__atomic_load_n (&done, __ATOMIC_ACQUIRE))
+        break;
+      else
+        wait_producers ();
+    }
+
+  // producers have stopped; pick up anything published since
+  while (drain_one ())
+    ;
+  flush_output ();
+  return NULL;
+}
+
+bool
+log_start (int verbosity, const char *pcap_path, uint16_t local_port,
+           size_t capacity)
+{
+  level = verbosity;
+  port = local_port;
+  if (pcap_path != NULL)
+    {
+      capture = pcap_open (pcap_path);
+      if (capture == NULL)
+        return false;
+    }
+  if (level <= LOG_QUIET && capture == NULL)
+    return true;
+
+  size_t size = 1;
+  while (size < capacity)
+    size <<= 1;
+
+  ring = calloc (size, sizeof (struct log_slot));
+  if (ring == NULL)
+    {
+      log_close_capture ();
+      return false;
+    }
+  mask = size - 1;
+  head = tail = 0;
+  dropped = 0;
+  for (size_t i = 0; i < size; i++)
+    ring[i].seq = i;
+
+  done = false;
+  sleeping = 0;
+  if (pthread_create (&thread, NULL, log_thread, NULL) != 0)
+    {
+      free (ring);
+      ring = NULL;
+      log_close_capture ();
+      return false;
+    }
+  running = true;
+  return true;
+}
+
+void
+log_packet (int direction, const struct sockaddr_in *peer,
+            const uint8_t *packet, size_t size)
+{
+  if (!running)
+    return;
+  if (size > MAX_DHCP_LENGTH)
+    size = MAX_DHCP_LENGTH;
+
+  size_t pos = __atomic_load_n (&tail, __ATOMIC_RELAXED);
+  struct log_slot *slot;
+  while (1)
+    {
+      slot = &ring[pos & mask];
+      size_t seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0)
+        {
+          if (__atomic_compare_exchange_n (&tail, &pos, pos + 1, true,
+                                           __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED))
+            break;
+        }
+      else if (diff < 0)
+        {
+          // ring is full; the dump is lost but serving goes on
+          __atomic_fetch_add (&dropped, 1, __ATOMIC_RELAXED);
+          metrics_count (&metrics_self ()->log_dropped);
+          return;
+        }
+      else
+        pos = __atomic_load_n (&tail, __ATOMIC_RELAXED);
+    }
+
+  memcpy (slot->data, packet, size);
+  // dump_msg reads the whole header and cookie even from a short packet
+  if (size < sizeof (msg_t) + 4)
+    memset (slot->data + size, 0, sizeof (msg_t) + 4 - size);
+  slot->size = size;
+  slot->direction = direction;
+  clock_gettime (CLOCK_REALTIME, &slot->when);
+  if (peer != NULL)
+    slot->peer = *peer;
+  else
+    memset (&slot->peer, 0, sizeof (slot->peer));
+  __atomic_store_n (&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  wake_consumer ();
+}
+
+void
+log_stop (void)
+{
+  if (!running)
+    return;
+
+  __atomic_store_n (&done, true, __ATOMIC_RELEASE);
+  wake_consumer ();
+  pthread_join (thread, NULL);
+  running = false;
+
+  // also reported at -v 0, where the lost packets are missing from -p
+  if (dropped > 0)
+    fprintf (stderr, "Log ring full: %zu packet(s) not logged\n", dropped);
+
+  free (ring);
+  ring = NULL;
+  log_close_capture ();
+}
@@ -0,0 +1,36 @@
+#ifndef __cs361_log_h__
+#define __cs361_log_h__
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Packet logging happens off the serving threads: log_packet copies the
+// raw datagram into a lock-free ring and a background thread formats it
+// with dump_msg. The text written to stdout is the same as dumping inline.
+// The same thread also appends each datagram to a pcapng capture when one
+// is requested (see pcap.h).
+
+// Verbosity levels (-v)
+#define LOG_QUIET 0   // no per-packet dumps
+#define LOG_PACKETS 1 // dump every packet received and sent (default)
+
+// Packet directions
+#define LOG_RECEIVED 0
+#define LOG_SENT 1
+
+// Start the logging thread with a ring of (at least) capacity packets.
+// If pcap_path is not NULL, traffic on local_port is also captured there.
+bool log_start (int verbosity, const char *pcap_path, uint16_t local_port,
+                size_t capacity);
+
+// Queue one packet exchanged with peer for dumping. Never blocks; if the
+// ring is full the packet is dropped and counted.
+void log_packet (int direction, const struct sockaddr_in *peer,
+                 const uint8_t *packet, size_t size);
+
+// Format everything still queued, then stop the logging thread
+void log_stop (void);
+
+#endif
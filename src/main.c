@@ -1,27 +1,73 @@
+#include <arpa/inet.h>
+#include <ctype.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "dhcp.h"
 #include "format.h"
+#include "log.h"
+#include "pcap.h"
+#include "pool.h"
 #include "port_utils.h"
+#include "ratelimit.h"
 #include "server.h"
 
-static bool get_args (int, char **, long *);
+static bool get_args (int, char **, struct server_config *);
 
 bool debug = false;
 
 int
 main (int argc, char **argv)
 {
-  long to_seconds = 2;
-  bool success = get_args (argc, argv, &to_seconds);
+  struct server_config config;
+  config.to_seconds = 2;
+  config.threads = 1;
+  config.max_clients = 0; // resolved in get_args
+  config.pool_first = 0;
+  config.pool_count = 0;
+  config.excludes = NULL;
+  config.nexcludes = 0;
+  config.relays = NULL;
+  config.nrelays = 0;
+  config.batch = 1;
+  config.reuseport = false;
+  config.rate_limit = 0;
+  config.rate_burst = 0;
+  config.uring = false;
+  config.lease_seconds = 30 * 24 * 60 * 60; // 30 days
+  config.offer_seconds = 60;
+  config.verbosity = LOG_PACKETS;
+  config.pcap_path = NULL;
+  config.metrics_path = NULL;
+  config.decode_path = NULL;
+  config.db_path = NULL;
+  config.journal_path = NULL;
+  config.commit_ms = 1;
+  config.commit_batch = 256;
+  bool success = get_args (argc, argv, &config);
   if (!success)
     return EXIT_FAILURE;
 
+  // offline mode: print a capture made with -p and exit
+  if (config.decode_path != NULL)
+    {
+      if (pcap_decode (config.decode_path, stdout) < 0)
+        {
+          fprintf (stderr, "Cannot decode %s\n", config.decode_path);
+          return EXIT_FAILURE;
+        }
+      return EXIT_SUCCESS;
+    }
+
   char *protocol = get_port ();
-  int socketfd = setup_server (protocol, to_seconds);
+  int socketfd = setup_server (protocol, &config);
+  free (config.excludes);
+  free (config.relays);
   if (socketfd < 0)
     return EXIT_FAILURE;
 
@@ -34,25 +80,164 @@ main (int argc, char **argv)
 }
 
 static bool
-get_args (int argc, char **argv, long *to_seconds)
+get_args (int argc, char **argv, struct server_config *config)
 {
+  const char *options = "b:c:df:g:hj:l:m:n:o:p:P:rR:s:t:uv:w:W:x:";
   int ch = 0;
-  while ((ch = getopt (argc, argv, "dhs:t:")) != -1)
+  char *endp = NULL;
+  while ((ch = getopt (argc, argv, options)) != -1)
     {
       switch (ch)
         {
+        case 'b':
+          config->batch = atoi (optarg);
+          if (config->batch < 1 || config->batch > 1024)
+            return false;
+          break;
+        case 'c':
+          config->max_clients = atol (optarg);
+          if (config->max_clients < 1)
+            return false;
+          break;
         case 'd':
           debug = true;
           break;
+        case 'f':
+          config->db_path = optarg;
+          break;
+        case 'g':
+          {
+            // GIADDR=CIDR
+            relay_pool_t relay;
+            char *cidr = strchr (optarg, '=');
+            struct in_addr giaddr;
+            if (cidr == NULL)
+              return false;
+            *cidr++ = '\0';
+            if (inet_pton (AF_INET, optarg, &giaddr) != 1
+                || giaddr.s_addr == 0
+                || !pool_parse_cidr (cidr, &relay.first, &relay.count))
+              return false;
+            relay.giaddr = ntohl (giaddr.s_addr);
+            relay_pool_t *relays
+                = realloc (config->relays,
+                           (config->nrelays + 1) * sizeof (relay_pool_t));
+            if (relays == NULL)
+              return false;
+            relays[config->nrelays++] = relay;
+            config->relays = relays;
+          }
+          break;
+        case 'j':
+          config->journal_path = optarg;
+          break;
+        case 'l':
+          config->lease_seconds = atol (optarg);
+          if (config->lease_seconds < 1 || config->lease_seconds > UINT32_MAX)
+            return false;
+          break;
+        case 'm':
+          config->metrics_path = optarg;
+          break;
+        case 'n':
+          if (!pool_parse_cidr (optarg, &config->pool_first,
+                                &config->pool_count))
+            return false;
+          break;
+        case 'o':
+          config->offer_seconds = atol (optarg);
+          if (config->offer_seconds < 1 || config->offer_seconds > UINT32_MAX)
+            return false;
+          break;
+        case 'p':
+          config->pcap_path = optarg;
+          break;
+        case 'P':
+          config->decode_path = optarg;
+          break;
+        case 'r':
+          config->reuseport = true;
+          break;
+        case 'R':
+          if (!ratelimit_parse (optarg, &config->rate_limit,
+                                &config->rate_burst))
+            return false;
+          break;
         case 's':
-          *to_seconds = atol (optarg);
+          config->to_seconds = atol (optarg);
           break;
         case 't':
-          // lets just ignore this for now, due it at later phase
+          // "-t N" sets the worker count; a bare "-t" (followed by another
+          // flag) uses one worker per online CPU
+          if (optarg == argv[optind - 1] && optarg[0] == '-'
+              && !isdigit ((unsigned char)optarg[1]))
+            {
+              config->threads = sysconf (_SC_NPROCESSORS_ONLN);
+              if (config->threads < 1)
+                config->threads = 1;
+              optind--;
+              break;
+            }
+          {
+            long threads = strtol (optarg, &endp, 10);
+            if (*optarg == '\0' || *endp != '\0' || threads < 1
+                || threads > INT_MAX)
+              return false;
+            config->threads = threads;
+          }
+          break;
+        case 'u':
+          config->uring = true;
+          break;
+        case 'v':
+          config->verbosity = atoi (optarg);
+          break;
+        case 'w':
+          config->commit_ms = atol (optarg);
+          if (config->commit_ms < 0)
+            return false;
+          break;
+        case 'W':
+          config->commit_batch = atol (optarg);
+          if (config->commit_batch < 1)
+            return false;
+          break;
+        case 'x':
+          {
+            addr_range_t range;
+            if (!pool_parse_range (optarg, &range.lo, &range.hi))
+              return false;
+            addr_range_t *excludes
+                = realloc (config->excludes, (config->nexcludes + 1)
+                                                 * sizeof (addr_range_t));
+            if (excludes == NULL)
+              return false;
+            excludes[config->nexcludes++] = range;
+            config->excludes = excludes;
+          }
           break;
         default:
           return false;
         }
     }
+
+  // without -n, hand out the max_clients addresses after 192.168.1.1;
+  // with it, default to a slot for every address in the range
+  if (config->pool_count == 0)
+    {
+      if (config->max_clients == 0)
+        config->max_clients = 4;
+      config->pool_first = (192U << 24) | (168 << 16) | (1 << 8) | 1;
+      config->pool_count = config->max_clients;
+    }
+  else if (config->max_clients == 0)
+    config->max_clients = config->pool_count;
+
+  // the journal applies on top of the database file
+  if (config->journal_path != NULL && config->db_path == NULL)
+    {
+      fprintf (stderr, "-j needs a lease database (-f)\n");
+      return false;
+    }
   return true;
 }
@@ -0,0 +1,297 @@
+#define _GNU_SOURCE // accept4
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define METRICS_THREADS 1024
+
+// Blocks of every thread that counted something; once the table is full,
+// later threads share the spare block
+static struct metrics *blocks[METRICS_THREADS];
+static int nblocks = 0;
+static struct metrics spare;
+static __thread struct metrics *self = NULL;
+
+static const char *type_names[METRICS_TYPES] = {
+  "unknown", "DISCOVER", "OFFER",   "REQUEST", "DECLINE",
+  "ACK",     "NAK",      "RELEASE", "INFORM",
+};
+
+static const char *nak_names[NAK_REASONS] = {
+  "missing_option", "wrong_server",   "no_lease",     "not_offered",
+  "wrong_address",  "pool_exhausted", "unknown_type",
+};
+
+struct metrics *
+metrics_self (void)
+{
+  if (self != NULL)
+    return self;
+
+  int i = __atomic_fetch_add (&nblocks, 1, __ATOMIC_RELAXED);
+  struct metrics *block = NULL;
+  if (i < METRICS_THREADS
+      && posix_memalign ((void **)&block, 64, sizeof (struct metrics)) == 0)
+    {
+      memset (block, 0, sizeof (struct metrics));
+      __atomic_store_n (&blocks[i], block, __ATOMIC_RELEASE);
+      self = block;
+    }
+  else
+    self = &spare;
+  return self;
+}
+
+static unsigned
+bucket_of (uint64_t ns)
+{
+  if (ns < (1U << HIST_SUB_BITS))
+    return ns;
+  unsigned exp = 63 - __builtin_clzll (ns);
+  if (exp >= HIST_MAX_EXP)
+    return HIST_BUCKETS - 1;
+  unsigned sub = (ns >> (exp - HIST_SUB_BITS)) & ((1U << HIST_SUB_BITS) - 1);
+  return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+// Largest value that falls into bucket i
+static uint64_t
+bucket_top (unsigned i)
+{
+  if (i < (1U << HIST_SUB_BITS))
+    return i;
+  unsigned exp = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  uint64_t sub = i & ((1U << HIST_SUB_BITS) - 1);
+  uint64_t width = 1ULL << (exp - HIST_SUB_BITS);
+  return (1ULL << exp) + (sub + 1) * width - 1;
+}
+
+void
+metrics_latency (struct metrics *metrics, uint64_t ns)
+{
+  metrics_count (&metrics->latency[bucket_of (ns)]);
+  __atomic_store_n (&metrics->latency_sum, metrics->latency_sum + ns,
+                    __ATOMIC_RELAXED);
+}
+
+int64_t
+metrics_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t
+metrics_quantile (const uint64_t hist[HIST_BUCKETS], double q)
+{
+  uint64_t count = 0;
+  for (unsigned i = 0; i < HIST_BUCKETS; i++)
+    count += hist[i];
+  if (count == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t)(q * count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < HIST_BUCKETS; i++)
+    {
+      seen += hist[i];
+      if (seen >= rank)
+        return bucket_top (i);
+    }
+  return bucket_top (HIST_BUCKETS - 1);
+}
+
+static void
+add_block (struct metrics *total, const struct metrics *block)
+{
+  // a block is nothing but counters
+  const uint64_t *from = (const uint64_t *)block;
+  uint64_t *to = (uint64_t *)total;
+  for (size_t w = 0; w < sizeof (struct metrics) / sizeof (uint64_t); w++)
+    to[w] += __atomic_load_n (&from[w], __ATOMIC_RELAXED);
+}
+
+// Add up the counters of every thread
+static void
+sum_blocks (struct metrics *total)
+{
+  memset (total, 0, sizeof (struct metrics));
+  int n = __atomic_load_n (&nblocks, __ATOMIC_RELAXED);
+  if (n > METRICS_THREADS)
+    n = METRICS_THREADS;
+  for (int b = 0; b < n; b++)
+    {
+      const struct metrics *block
+          = __atomic_load_n (&blocks[b], __ATOMIC_ACQUIRE);
+      if (block != NULL) // NULL while still being set up
+        add_block (total, block);
+    }
+  add_block (total, &spare);
+}
+
+static void
+write_counter (FILE *out, const char *name, const char *help,
+               uint64_t value)
+{
+  fprintf (out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help,
+           name, name, (unsigned long)value);
+}
+
+void
+metrics_write (FILE *out)
+{
+  struct metrics total;
+  sum_blocks (&total);
+
+  fprintf (out, "# HELP dhcps_packets_received_total DHCP messages "
+                "received, by message type\n"
+                "# TYPE dhcps_packets_received_total counter\n");
+  for (int t = 0; t < METRICS_TYPES; t++)
+    fprintf (out, "dhcps_packets_received_total{type=\"%s\"} %lu\n",
+             type_names[t], (unsigned long)total.received[t]);
+  fprintf (out, "# HELP dhcps_packets_sent_total DHCP messages sent, by "
+                "message type\n"
+                "# TYPE dhcps_packets_sent_total counter\n");
+  for (int t = 0; t < METRICS_TYPES; t++)
+    fprintf (out, "dhcps_packets_sent_total{type=\"%s\"} %lu\n",
+             type_names[t], (unsigned long)total.sent[t]);
+  fprintf (out, "# HELP dhcps_naks_total NAKs sent, by reason\n"
+                "# TYPE dhcps_naks_total counter\n");
+  for (int r = 0; r < NAK_REASONS; r++)
+    fprintf (out, "dhcps_naks_total{reason=\"%s\"} %lu\n", nak_names[r],
+             (unsigned long)total.naks[r]);
+
+  write_counter (out, "dhcps_pool_exhausted_total",
+                 "DISCOVERs for which no lease could be assigned",
+                 total.exhausted);
+  write_counter (out, "dhcps_parse_failures_total",
+                 "Messages with malformed options", total.parse_failures);
+  write_counter (out, "dhcps_dropped_total",
+                 "Relayed messages for a subnet without a pool",
+                 total.dropped);
+  write_counter (out, "dhcps_replayed_total",
+                 "Retransmits answered from the reply cache",
+                 total.replayed);
+  write_counter (out, "dhcps_rate_limited_total",
+                 "Messages dropped by the per-client rate limit",
+                 total.limited);
+  write_counter (out, "dhcps_log_dropped_total",
+                 "Packet dumps lost because the log ring was full",
+                 total.log_dropped);
+
+  // cumulative buckets at every power of two from 1024 ns. Bucket
+  // boundaries fall on them, so each count is exactly the latencies below
+  // le; one of exactly le ns is only counted from the next le on.
+  const char *name = "dhcps_reply_latency_seconds";
+  fprintf (out,
+           "# HELP %s Time from receiving a request to sending its reply\n"
+           "# TYPE %s histogram\n",
+           name, name);
+  uint64_t count = 0;
+  unsigned next = 0;
+  for (unsigned exp = 10; exp <= HIST_MAX_EXP; exp++)
+    {
+      for (; next < HIST_BUCKETS && bucket_top (next) < (1ULL << exp); next++)
+        count += total.latency[next];
+      fprintf (out, "%s_bucket{le=\"%.9g\"} %lu\n", name,
+               (double)(1ULL << exp) / 1e9, (unsigned long)count);
+    }
+  for (; next < HIST_BUCKETS; next++)
+    count += total.latency[next];
+  fprintf (out, "%s_bucket{le=\"+Inf\"} %lu\n", name, (unsigned long)count);
+  fprintf (out, "%s_sum %.9g\n%s_count %lu\n", name,
+           (double)total.latency_sum / 1e9, name, (unsigned long)count);
+
+  fprintf (out,
+           "# HELP dhcps_reply_latency_quantile_seconds Reply latency "
+           "quantiles, to within 6.25%%\n"
+           "# TYPE dhcps_reply_latency_quantile_seconds gauge\n");
+  const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  for (size_t q = 0; q < sizeof (quantiles) / sizeof (quantiles[0]); q++)
+    fprintf (out,
+             "dhcps_reply_latency_quantile_seconds{quantile=\"%g\"} %.9g\n",
+             quantiles[q],
+             metrics_quantile (total.latency, quantiles[q]) / 1e9);
+}
+
+int
+metrics_listen (const char *path)
+{
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen (path) >= sizeof (addr.sun_path))
+    {
+      fprintf (stderr, "Metrics socket path too long: %s\n", path);
+      return -1;
+    }
+  strcpy (addr.sun_path, path);
+
+  int sock = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    {
+      perror ("socket");
+      return -1;
+    }
+  // replace a socket left behind by an earlier run, but no other file
+  struct stat st;
+  if (lstat (path, &st) == 0 && !S_ISSOCK (st.st_mode))
+    {
+      close (sock);
+      errno = ENOTSOCK;
+      perror (path);
+      return -1;
+    }
+  if ((unlink (path) < 0 && errno != ENOENT)
+      || bind (sock, (struct sockaddr *)&addr, sizeof (addr)) < 0
+      || listen (sock, 16) < 0)
+    {
+      perror (path);
+      close (sock);
+      return -1;
+    }
+  return sock;
+}
+
+void
+metrics_scrape (int listener)
+{
+  int conn = accept4 (listener, NULL, NULL, SOCK_CLOEXEC);
+  if (conn < 0)
+    return;
+
+  // worker 0 serves DHCP too, so the text goes out in one send that
+  // never blocks; a client that does not read loses what does not fit
+  // in the socket buffer, and one that hung up raises no SIGPIPE
+  char *text = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream (&text, &len);
+  if (out != NULL)
+    {
+      metrics_write (out);
+      if (fclose (out) == 0)
+        send (conn, text, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+  free (text);
+  close (conn);
+}
+
+void
+metrics_close (int listener, const char *path)
+{
+  if (listener < 0)
+    return;
+  close (listener);
+  unlink (path);
+}
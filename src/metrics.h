@@ -0,0 +1,84 @@
+#ifndef __cs361_metrics_h__
+#define __cs361_metrics_h__
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Counters and reply latency histograms (-m). Every thread counts into a
+// block of its own that only it writes, so counting is a plain relaxed
+// store with no locks and no shared cache lines. A scrape sums the blocks
+// of every thread with relaxed loads; totals are exact once the threads
+// are quiet and at most a few counts behind while they are not.
+//
+// Latencies are kept HDR-style: exact below 2^HIST_SUB_BITS ns, then
+// 2^HIST_SUB_BITS buckets per power of two, so any recorded value is off
+// by at most 1/2^HIST_SUB_BITS (6.25%). Values from 2^HIST_MAX_EXP ns
+// (about 69 s) up land in the last bucket.
+
+#define HIST_SUB_BITS 4
+#define HIST_MAX_EXP 36
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+// Message types 1 (DHCPDISCOVER) to 8 (DHCPINFORM); 0 counts anything else
+#define METRICS_TYPES 9
+
+// Why a NAK was sent
+enum nak_reason
+{
+  NAK_MISSING_OPTION, // REQUEST without server ID or requested address
+  NAK_WRONG_SERVER,   // REQUEST for another server
+  NAK_NO_LEASE,       // REQUEST from a client holding no lease
+  NAK_NOT_OFFERED,    // REQUEST for a lease that is not on offer
+  NAK_WRONG_ADDRESS,  // REQUEST for another address than the one offered
+  NAK_POOL_EXHAUSTED, // DISCOVER with no address left to offer
+  NAK_UNKNOWN_TYPE,   // message type the server does not handle
+  NAK_REASONS
+};
+
+struct metrics
+{
+  uint64_t received[METRICS_TYPES];
+  uint64_t sent[METRICS_TYPES]; // replies the kernel accepted
+  uint64_t naks[NAK_REASONS];
+  uint64_t exhausted;      // lease_assign found no slot or address
+  uint64_t parse_failures; // malformed options
+  uint64_t dropped;        // relayed requests for a subnet not served
+  uint64_t replayed;       // retransmits answered from the reply cache
+  uint64_t limited;        // dropped by the per-client rate limit (-R)
+  uint64_t log_dropped;    // packet dumps lost to a full log ring
+  uint64_t latency[HIST_BUCKETS]; // receive to send, ns
+  uint64_t latency_sum;
+} __attribute__ ((aligned (64)));
+
+// The calling thread's block, set up on first use
+struct metrics *metrics_self (void);
+
+// Bump a counter of the calling thread's block
+static inline void
+metrics_count (uint64_t *counter)
+{
+  __atomic_store_n (counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+// Record a reply latency of ns nanoseconds
+void metrics_latency (struct metrics *metrics, uint64_t ns);
+
+// Monotonic clock in ns, for latencies
+int64_t metrics_now (void);
+
+// Smallest value v such that a fraction q of the recorded values are at
+// most v, to histogram precision
+uint64_t metrics_quantile (const uint64_t hist[HIST_BUCKETS], double q);
+
+// Write the sum over all threads in the Prometheus text format
+void metrics_write (FILE *out);
+
+// Listen on a Unix stream socket at path (replacing a stale socket, but
+// refusing to replace any other file). Every connection accepted by
+// metrics_scrape gets one metrics_write, sent without blocking, and is
+// closed. Returns the non-blocking listening socket, or -1.
+int metrics_listen (const char *path);
+void metrics_scrape (int listener);
+void metrics_close (int listener, const char *path);
+
+#endif
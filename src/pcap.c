@@ -0,0 +1,207 @@
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dhcp.h"
+#include "format.h"
+#include "pcap.h"
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+#define LINKTYPE_IPV4 228
+
+#define OPT_END 0
+#define OPT_EPB_FLAGS 2
+#define EPB_INBOUND 1
+#define EPB_OUTBOUND 2
+
+#define IP_HDR_LEN 20
+#define UDP_HDR_LEN 8
+#define CAPTURE_BUFFER (1 << 20)
+
+static void
+put32 (FILE *capture, uint32_t value)
+{
+  fwrite (&value, 4, 1, capture);
+}
+
+static uint16_t
+ip_checksum (const uint8_t *header, size_t len)
+{
+  uint32_t sum = 0;
+  for (size_t i = 0; i < len; i += 2)
+    sum += (header[i] << 8) | header[i + 1];
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return htons (~sum & 0xffff);
+}
+
+FILE *
+pcap_open (const char *path)
+{
+  FILE *capture = fopen (path, "wb");
+  if (capture == NULL)
+    return NULL;
+  setvbuf (capture, NULL, _IOFBF, CAPTURE_BUFFER);
+
+  // section header block: no options, unknown section length
+  put32 (capture, PCAPNG_SHB);
+  put32 (capture, 28);
+  put32 (capture, PCAPNG_BYTE_ORDER);
+  uint16_t version[2] = { 1, 0 };
+  fwrite (version, 2, 2, capture);
+  int64_t section_length = -1;
+  fwrite (&section_length, 8, 1, capture);
+  put32 (capture, 28);
+
+  // interface description block: raw IPv4, no snap limit, microseconds
+  put32 (capture, PCAPNG_IDB);
+  put32 (capture, 20);
+  uint16_t link[2] = { LINKTYPE_IPV4, 0 };
+  fwrite (link, 2, 2, capture);
+  put32 (capture, 0);
+  put32 (capture, 20);
+
+  return capture;
+}
+
+void
+pcap_write (FILE *capture, bool sent, const struct timespec *when,
+            const struct sockaddr_in *peer, uint16_t local_port,
+            const uint8_t *data, size_t size)
+{
+  uint8_t headers[IP_HDR_LEN + UDP_HDR_LEN];
+  memset (headers, 0, sizeof (headers));
+
+  // the local address is not known per packet; leave it as 0.0.0.0
+  uint32_t local_ip = 0;
+  uint32_t peer_ip = peer != NULL ? peer->sin_addr.s_addr : 0;
+  uint16_t peer_port = peer != NULL ? peer->sin_port : 0;
+  uint16_t port = htons (local_port);
+  uint16_t ip_len = htons (IP_HDR_LEN + UDP_HDR_LEN + size);
+  uint16_t udp_len = htons (UDP_HDR_LEN + size);
+
+  headers[0] = 0x45; // IPv4, 5-word header
+  memcpy (headers + 2, &ip_len, 2);
+  headers[8] = 64; // TTL
+  headers[9] = IPPROTO_UDP;
+  memcpy (headers + 12, sent ? &local_ip : &peer_ip, 4);
+  memcpy (headers + 16, sent ? &peer_ip : &local_ip, 4);
+  uint16_t checksum = ip_checksum (headers, IP_HDR_LEN);
+  memcpy (headers + 10, &checksum, 2);
+
+  uint8_t *udp = headers + IP_HDR_LEN;
+  memcpy (udp, sent ? &port : &peer_port, 2);
+  memcpy (udp + 2, sent ? &peer_port : &port, 2);
+  memcpy (udp + 4, &udp_len, 2);
+  // UDP checksum left as 0 (not computed)
+
+  uint32_t caplen = sizeof (headers) + size;
+  uint32_t padded = (caplen + 3) & ~3U;
+  // block header, interface, timestamp, lengths, data, flags option, end
+  uint32_t block_len = 28 + padded + 8 + 4 + 4;
+  uint64_t usec = (uint64_t)when->tv_sec * 1000000 + when->tv_nsec / 1000;
+
+  put32 (capture, PCAPNG_EPB);
+  put32 (capture, block_len);
+  put32 (capture, 0);
+  put32 (capture, (uint32_t)(usec >> 32));
+  put32 (capture, (uint32_t)usec);
+  put32 (capture, caplen);
+  put32 (capture, caplen);
+  fwrite (headers, sizeof (headers), 1, capture);
+  fwrite (data, size, 1, capture);
+  uint8_t pad[3] = { 0, 0, 0 };
+  fwrite (pad, padded - caplen, 1, capture);
+
+  uint16_t flags_opt[2] = { OPT_EPB_FLAGS, 4 };
+  fwrite (flags_opt, 2, 2, capture);
+  put32 (capture, sent ? EPB_OUTBOUND : EPB_INBOUND);
+  put32 (capture, OPT_END);
+  put32 (capture, block_len);
+}
+
+// Find the direction flags in an enhanced packet block's options
+static bool
+epb_sent (const uint8_t *options, size_t len)
+{
+  size_t pos = 0;
+  while (pos + 4 <= len)
+    {
+      uint16_t code, optlen;
+      memcpy (&code, options + pos, 2);
+      memcpy (&optlen, options + pos + 2, 2);
+      pos += 4;
+      if (code == OPT_END || pos + optlen > len)
+        break;
+      if (code == OPT_EPB_FLAGS && optlen == 4)
+        {
+          uint32_t flags;
+          memcpy (&flags, options + pos, 4);
+          return (flags & 3) == EPB_OUTBOUND;
+        }
+      pos += (optlen + 3) & ~3U;
+    }
+  return false;
+}
+
+int
+pcap_decode (const char *path, FILE *output)
+{
+  FILE *capture = fopen (path, "rb");
+  if (capture == NULL)
+    return -1;
+
+  int count = 0;
+  bool first = true;
+  uint32_t header[2];
+  while (fread (header, 4, 2, capture) == 2)
+    {
+      uint32_t type = header[0];
+      uint32_t len = header[1];
+      if ((first && type != PCAPNG_SHB) || len < 12 || len % 4 != 0)
+        {
+          count = -1;
+          break;
+        }
+      first = false;
+
+      uint8_t *body = malloc (len - 8);
+      if (body == NULL || fread (body, len - 8, 1, capture) != 1)
+        {
+          free (body);
+          break;
+        }
+
+      uint32_t caplen = 0;
+      if (type == PCAPNG_EPB && len >= 32)
+        memcpy (&caplen, body + 12, 4);
+      if (type == PCAPNG_EPB && len >= 32 && caplen <= len - 32)
+        {
+          uint8_t *packet = body + 20;
+          size_t ihl = (packet[0] & 0x0f) * 4;
+          if (caplen >= ihl + UDP_HDR_LEN)
+            {
+              size_t size = caplen - ihl - UDP_HDR_LEN;
+              size_t opts = 20 + ((caplen + 3) & ~3U);
+              size_t optlen = len - 12 > opts ? len - 12 - opts : 0;
+              bool sent = epb_sent (body + opts, optlen);
+
+              // dump_msg reads the full header, so decode from a copy
+              uint8_t msg[MAX_DHCP_LENGTH] __attribute__ ((aligned (8)));
+              memset (msg, 0, sizeof (msg));
+              if (size > MAX_DHCP_LENGTH)
+                size = MAX_DHCP_LENGTH;
+              memcpy (msg, packet + ihl + UDP_HDR_LEN, size);
+              dump_traffic (output, sent, (msg_t *)msg, size);
+              count++;
+            }
+        }
+      free (body);
+    }
+
+  fclose (capture);
+  return count;
+}
@@ -0,0 +1,29 @@
+#ifndef __cs361_pcap_h__
+#define __cs361_pcap_h__
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Binary capture of the server's traffic in pcapng format. Each DHCP
+// datagram is wrapped in a synthesized IPv4/UDP header (LINKTYPE_IPV4) so
+// standard tools can read it, and the enhanced packet block's flags record
+// whether it was received (inbound) or sent (outbound).
+
+// Create the capture file and write the section and interface headers.
+// The stream gets a large buffer; records are only written out in bulk.
+FILE *pcap_open (const char *path);
+
+// Append one datagram exchanged with peer on the server's local_port
+void pcap_write (FILE *capture, bool sent, const struct timespec *when,
+                 const struct sockaddr_in *peer, uint16_t local_port,
+                 const uint8_t *data, size_t size);
+
+// Decode a capture written by pcap_write, printing every datagram the way
+// the server logs it (see dump_traffic). Returns the number of packets
+// decoded, or -1 if the file cannot be read as pcapng.
+int pcap_decode (const char *path, FILE *output);
+
+#endif
@@ -0,0 +1,228 @@
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+struct pool
+{
+  pthread_mutex_t lock;
+  uint32_t first; // host byte order
+  uint32_t count;
+
+  uint64_t *bits;    // one bit per address, set while available
+  uint64_t *summary; // one bit per word of bits, set while it is nonzero
+  size_t nwords;
+  size_t nsummary;
+  size_t hint; // every summary word below this is zero
+  size_t available;
+};
+
+pool_t *
+pool_create (uint32_t first, uint32_t count)
+{
+  if (count == 0)
+    return NULL;
+
+  pool_t *pool = calloc (1, sizeof (pool_t));
+  if (pool == NULL)
+    return NULL;
+  pthread_mutex_init (&pool->lock, NULL);
+  pool->first = first;
+  pool->count = count;
+  pool->nwords = ((size_t)count + 63) / 64;
+  pool->nsummary = (pool->nwords + 63) / 64;
+  pool->bits = malloc (pool->nwords * sizeof (uint64_t));
+  pool->summary = malloc (pool->nsummary * sizeof (uint64_t));
+  if (pool->bits == NULL || pool->summary == NULL)
+    {
+      pool_destroy (pool);
+      return NULL;
+    }
+
+  // every address available; the tails past count stay clear
+  memset (pool->bits, 0xff, pool->nwords * sizeof (uint64_t));
+  memset (pool->summary, 0xff, pool->nsummary * sizeof (uint64_t));
+  if (count % 64 != 0)
+    pool->bits[pool->nwords - 1] = (1ULL << (count % 64)) - 1;
+  if (pool->nwords % 64 != 0)
+    pool->summary[pool->nsummary - 1] = (1ULL << (pool->nwords % 64)) - 1;
+  pool->available = count;
+
+  return pool;
+}
+
+void
+pool_destroy (pool_t *pool)
+{
+  if (pool == NULL)
+    return;
+  free (pool->bits);
+  free (pool->summary);
+  pthread_mutex_destroy (&pool->lock);
+  free (pool);
+}
+
+// Index of ip in the pool, or -1 if it is outside
+static int64_t
+offset_of (const pool_t *pool, struct in_addr ip)
+{
+  uint32_t offset = ntohl (ip.s_addr) - pool->first;
+  return offset < pool->count ? (int64_t)offset : -1;
+}
+
+static bool
+is_set (const pool_t *pool, size_t i)
+{
+  return (pool->bits[i / 64] >> (i % 64)) & 1;
+}
+
+static void
+take (pool_t *pool, size_t i)
+{
+  size_t w = i / 64;
+  pool->bits[w] &= ~(1ULL << (i % 64));
+  if (pool->bits[w] == 0)
+    pool->summary[w / 64] &= ~(1ULL << (w % 64));
+  __atomic_store_n (&pool->available, pool->available - 1, __ATOMIC_RELAXED);
+}
+
+static void
+give (pool_t *pool, size_t i)
+{
+  size_t w = i / 64;
+  pool->bits[w] |= 1ULL << (i % 64);
+  pool->summary[w / 64] |= 1ULL << (w % 64);
+  if (w / 64 < pool->hint)
+    pool->hint = w / 64;
+  __atomic_store_n (&pool->available, pool->available + 1, __ATOMIC_RELAXED);
+}
+
+void
+pool_exclude (pool_t *pool, uint32_t lo, uint32_t hi)
+{
+  uint32_t last = pool->first + pool->count - 1;
+  if (hi < pool->first || lo > last)
+    return;
+  if (lo < pool->first)
+    lo = pool->first;
+  if (hi > last)
+    hi = last;
+
+  pthread_mutex_lock (&pool->lock);
+  for (uint64_t a = lo; a <= hi; a++)
+    {
+      size_t i = a - pool->first;
+      if (is_set (pool, i))
+        take (pool, i);
+    }
+  pthread_mutex_unlock (&pool->lock);
+}
+
+bool
+pool_alloc (pool_t *pool, struct in_addr *ip)
+{
+  bool found = false;
+  pthread_mutex_lock (&pool->lock);
+  for (; pool->hint < pool->nsummary; pool->hint++)
+    {
+      uint64_t s = pool->summary[pool->hint];
+      if (s == 0)
+        continue;
+      size_t w = pool->hint * 64 + __builtin_ctzll (s);
+      size_t i = w * 64 + __builtin_ctzll (pool->bits[w]);
+      take (pool, i);
+      ip->s_addr = htonl (pool->first + i);
+      found = true;
+      break;
+    }
+  pthread_mutex_unlock (&pool->lock);
+  return found;
+}
+
+bool
+pool_reserve (pool_t *pool, struct in_addr ip)
+{
+  int64_t i = offset_of (pool, ip);
+  if (i < 0)
+    return false;
+  pthread_mutex_lock (&pool->lock);
+  bool found = is_set (pool, i);
+  if (found)
+    take (pool, i);
+  pthread_mutex_unlock (&pool->lock);
+  return found;
+}
+
+void
+pool_free (pool_t *pool, struct in_addr ip)
+{
+  int64_t i = offset_of (pool, ip);
+  if (i < 0)
+    return;
+  pthread_mutex_lock (&pool->lock);
+  if (!is_set (pool, i))
+    give (pool, i);
+  pthread_mutex_unlock (&pool->lock);
+}
+
+size_t
+pool_available (const pool_t *pool)
+{
+  return __atomic_load_n (&pool->available, __ATOMIC_RELAXED);
+}
+
+bool
+pool_parse_cidr (const char *text, uint32_t *first, uint32_t *count)
+{
+  char addr[INET_ADDRSTRLEN];
+  const char *slash = strchr (text, '/');
+  if (slash == NULL || slash - text >= INET_ADDRSTRLEN)
+    return false;
+  memcpy (addr, text, slash - text);
+  addr[slash - text] = '\0';
+
+  struct in_addr base;
+  char *end = NULL;
+  long len = strtol (slash + 1, &end, 10);
+  if (inet_pton (AF_INET, addr, &base) != 1 || *end != '\0' || end == slash + 1
+      || len < 1 || len > 32)
+    return false;
+
+  uint64_t size = 1ULL << (32 - len);
+  uint32_t network = ntohl (base.s_addr) & (uint32_t)~(size - 1);
+  if (len >= 31)
+    {
+      *first = network;
+      *count = size;
+    }
+  else
+    {
+      *first = network + 1;
+      *count = size - 2;
+    }
+  return true;
+}
+
+bool
+pool_parse_range (const char *text, uint32_t *lo, uint32_t *hi)
+{
+  char addr[INET_ADDRSTRLEN];
+  const char *dash = strchr (text, '-');
+  size_t len = dash != NULL ? (size_t)(dash - text) : strlen (text);
+  if (len >= INET_ADDRSTRLEN)
+    return false;
+  memcpy (addr, text, len);
+  addr[len] = '\0';
+
+  struct in_addr a, b;
+  if (inet_pton (AF_INET, addr, &a) != 1)
+    return false;
+  b = a;
+  if (dash != NULL && inet_pton (AF_INET, dash + 1, &b) != 1)
+    return false;
+  *lo = ntohl (a.s_addr);
+  *hi = ntohl (b.s_addr);
+  return *lo <= *hi;
+}
@@ -0,0 +1,47 @@
+#ifndef __cs361_pool_h__
+#define __cs361_pool_h__
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Address pool over a contiguous range (-n CIDR), minus excluded ranges
+// (-x). Available addresses are bits in a bitmap, with a summary bitmap
+// of the words that still have a bit set and a hint below which every
+// summary word is empty. Handing out the lowest available address is a
+// couple of find-first-set scans whatever the size of the range.
+//
+// Every call takes the pool's own lock, so one pool can back the lease
+// tables of several shards.
+
+typedef struct pool pool_t;
+
+// Pool of count addresses starting at first (host byte order), all
+// available
+pool_t *pool_create (uint32_t first, uint32_t count);
+void pool_destroy (pool_t *pool);
+
+// Make the addresses lo..hi (inclusive, host byte order) unavailable;
+// the parts outside the pool are ignored
+void pool_exclude (pool_t *pool, uint32_t lo, uint32_t hi);
+
+// Take the lowest available address. Returns false if there is none.
+bool pool_alloc (pool_t *pool, struct in_addr *ip);
+
+// Take a specific address. Returns false if it is not available.
+bool pool_reserve (pool_t *pool, struct in_addr ip);
+
+// Make an address taken with pool_alloc or pool_reserve available again
+void pool_free (pool_t *pool, struct in_addr ip);
+
+size_t pool_available (const pool_t *pool);
+
+// Parse "a.b.c.d/len" into its usable host addresses: all but the
+// network and broadcast addresses, unless len is 31 or 32
+bool pool_parse_cidr (const char *text, uint32_t *first, uint32_t *count);
+
+// Parse "a.b.c.d" or "a.b.c.d-e.f.g.h" into an inclusive range
+bool pool_parse_range (const char *text, uint32_t *lo, uint32_t *hi);
+
+#endif
@@ -0,0 +1,97 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "ratelimit.h"
+
+// Odd multipliers that spread one key hash over the rows
+static const uint32_t row_seeds[RATELIMIT_DEPTH] = {
+  0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f,
+};
+
+struct ratelimit
+{
+  int64_t interval;  // ns between packets at the sustained rate
+  int64_t tolerance; // how far ahead of now a bucket may run, ns
+  int64_t cells[RATELIMIT_DEPTH][RATELIMIT_WIDTH]; // arrival times, ns
+};
+
+// Whether rate and burst are finite, positive and slow enough that the
+// bucket's tolerance in ns fits an int64_t
+static bool
+valid (double rate, double burst)
+{
+  return isfinite (rate) && isfinite (burst) && rate > 0 && burst >= 1
+         && 1e9 / rate * burst < (double)INT64_MAX;
+}
+
+ratelimit_t *
+ratelimit_create (double rate, double burst)
+{
+  if (!valid (rate, burst))
+    return NULL;
+  ratelimit_t *limiter = calloc (1, sizeof (ratelimit_t));
+  if (limiter == NULL)
+    return NULL;
+  limiter->interval = 1e9 / rate;
+  limiter->tolerance = limiter->interval * (burst - 1);
+  return limiter;
+}
+
+void
+ratelimit_destroy (ratelimit_t *limiter)
+{
+  free (limiter);
+}
+
+bool
+ratelimit_allow (ratelimit_t *limiter, uint32_t key, int64_t now_ns)
+{
+  int64_t *cells[RATELIMIT_DEPTH];
+  int64_t tat = INT64_MAX;
+  for (int row = 0; row < RATELIMIT_DEPTH; row++)
+    {
+      uint32_t column = (key * row_seeds[row]) >> (32 - RATELIMIT_WIDTH_BITS);
+      cells[row] = &limiter->cells[row][column];
+      int64_t cell = __atomic_load_n (cells[row], __ATOMIC_RELAXED);
+      if (cell < tat)
+        tat = cell;
+    }
+
+  // GCRA: the bucket is empty once its arrival time is now or earlier
+  if (tat < now_ns)
+    tat = now_ns;
+  if (tat - now_ns > limiter->tolerance)
+    return false;
+
+  // conservative update: only raise the cells that are behind
+  int64_t next = tat + limiter->interval;
+  for (int row = 0; row < RATELIMIT_DEPTH; row++)
+    {
+      int64_t cell = __atomic_load_n (cells[row], __ATOMIC_RELAXED);
+      while (cell < next
+             && !__atomic_compare_exchange_n (cells[row], &cell, next, true,
+                                              __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED))
+        ;
+    }
+  return true;
+}
+
+bool
+ratelimit_parse (const char *text, double *rate, double *burst)
+{
+  char *end = NULL;
+  *rate = strtod (text, &end);
+  if (end == text)
+    return false;
+  *burst = *rate < 1 ? 1 : *rate;
+  if (*end == ':')
+    {
+      const char *start = end + 1;
+      *burst = strtod (start, &end);
+      if (end == start)
+        return false;
+    }
+  // strtod also takes "nan" and "inf", and turns "1e-400" into 0
+  return *end == '\0' && valid (*rate, *burst);
+}
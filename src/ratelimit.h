@@ -0,0 +1,35 @@
+#ifndef __cs361_ratelimit_h__
+#define __cs361_ratelimit_h__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Per-client rate limit (-R) applied to every datagram before it is parsed.
+// Each client is a GCRA token bucket: rate packets per second on average,
+// with bursts of up to burst packets. Instead of one bucket per client the
+// buckets live in a count-min sketch, RATELIMIT_DEPTH rows of
+// RATELIMIT_WIDTH theoretical arrival times, so the memory is fixed
+// whatever the number of clients. A client's bucket is the earliest of
+// its cells: other clients sharing a cell can only make it later, so a
+// client is never limited below its rate unless it collides with a busy
+// client in every row. Cells are updated with compare-and-swap; racing
+// threads may let a packet or two more through, never fewer.
+
+#define RATELIMIT_DEPTH 4
+#define RATELIMIT_WIDTH_BITS 12
+#define RATELIMIT_WIDTH (1 << RATELIMIT_WIDTH_BITS)
+
+typedef struct ratelimit ratelimit_t;
+
+ratelimit_t *ratelimit_create (double rate, double burst);
+void ratelimit_destroy (ratelimit_t *limiter);
+
+// Whether a packet from the client with this key hash (see lease_key_hash)
+// arriving at now_ns (CLOCK_MONOTONIC) is within its limit
+bool ratelimit_allow (ratelimit_t *limiter, uint32_t key, int64_t now_ns);
+
+// Parse "RATE" or "RATE:BURST" (packets per second, packets); the burst
+// defaults to the rate, i.e. one second's worth
+bool ratelimit_parse (const char *text, double *rate, double *burst);
+
+#endif
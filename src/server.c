@@ -1,448 +1,1613 @@
+#define _GNU_SOURCE // recvmmsg, sendmmsg
+
 #include <arpa/inet.h>
+#include <errno.h>
 #include <getopt.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "dhcp.h"
 #include "format.h"
+#include "journal.h"
+#include "lease.h"
+#include "leasedb.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
 #include "port_utils.h"
 #include "server.h"
-
-#define MAX_IPS 5
-#define MAX_CLIENTS 4
-#define CHADDR_LEN 16
+#include "uring.h"
+
+#define IDLE_TICK_MS 250
+#define DRAIN_LIMIT 64 // datagrams taken per wakeup before polling again
+
+// io_uring backend (-u): ring size and receive buffers per worker
+#define URING_ENTRIES 256
+#define URING_BUFFERS 128
+#define URING_BUFFER_SIZE                                                    \
+  (sizeof (struct io_uring_recvmsg_out) + sizeof (struct sockaddr_in)        \
+   + MAX_DHCP_LENGTH)
+
+// Kinds of io_uring requests, in the high half of their user_data
+#define TAG_RECV 1
+#define TAG_SEND 2
+#define TAG_POLL 3
+#define TAG(kind, index) ((uint64_t)(kind) << 32 | (uint32_t)(index))
+#define LOG_RING_SIZE 4096
+#define REPLY_CACHE_SIZE 1024 // entries per shard, a power of two
 
 struct in_addr THIS_SERVER;
 
-struct lease
+// Each subnet's lease store is split into shards by a hash of the client
+// key (lease_store_pick). A shard owns one table of the store, with its
+// own index and lock, so workers serving different clients rarely
+// contend; the slots and addresses are the subnet's, shared by all of its
+// shards, so no client is refused while another shard could have served
+// it. Without -r there is a single shard per subnet.
+struct lease_shard
 {
-  bool used;
-  bool pending;
+  pthread_mutex_t lock;
+  lease_table_t *table;
+  struct cached_reply *replies; // REPLY_CACHE_SIZE entries
+};
+
+// Outcome of a recently answered DISCOVER or REQUEST, so that a
+// retransmit (same xid, client and type) is answered again without going
+// through the lease table. Entries are placed by client key: a client's
+// newer request replaces its older one.
+struct cached_reply
+{
+  uint32_t xid;
+  uint8_t type; // of the request; 0 for an unused entry
+  uint8_t htype;
+  uint8_t hlen;
+  uint8_t reply_type;
   uint8_t chaddr[CHADDR_LEN];
-  struct in_addr ip;
+  struct in_addr yiaddr;
+  uint64_t lsn; // journal entry the reply promised, or 0
 };
 
-static struct lease leases[MAX_CLIENTS];
+static struct lease_shard *shards = NULL;
+static int nshards = 0;
 
-static void
-init_leases (void)
+// Clients are served from the subnet of the relay agent that forwarded
+// their request (giaddr), or the local one (0.0.0.0) when there is none.
+// Each subnet owns shards [first, first + count) and the store and pool
+// they share, so subnets never share a lock, lease table or pool.
+struct subnet
+{
+  struct in_addr giaddr;
+  int first;
+  int count;
+  lease_store_t *store; // one table per shard
+  pool_t *pool;
+};
+
+static struct subnet *subnets = NULL;
+static int nsubnets = 0;
+
+// Open-addressing index from giaddr to subnet, -1 for an empty bucket
+static int32_t *subnet_buckets = NULL;
+static size_t subnet_mask = 0;
+
+// Backing file of every subnet's records (-f) and its journal (-j), or NULL
+static lease_db_t *lease_db = NULL;
+static journal_t *journal = NULL;
+
+// Set once a worker decides the server is done (phase 1 reply sent)
+static bool stopping = false;
+
+// Event sources besides the sockets. Every worker's epoll set watches
+// stop_fd, which becomes readable for good once the server is stopping.
+// Worker 0 also owns the housekeeping tick (timer_fd) and SIGINT/SIGTERM,
+// plus SIGUSR1 for a trace dump (signal_fd), which are blocked in every
+// thread while serving.
+static int stop_fd = -1;
+static int timer_fd = -1;
+static int signal_fd = -1;
+static sigset_t old_sigmask;
+
+// Per-client rate limit shared by every worker (-R), or NULL
+static ratelimit_t *limiter = NULL;
+
+// Listening Unix socket for metrics scrapes (-m), also owned by worker 0
+static int metrics_fd = -1;
+static const char *metrics_path = NULL;
+
+// Monotonic time (ms) of the last datagram any worker received
+static int64_t last_activity = 0;
+
+// Lease clock: whole seconds since the server started, which was at
+// wall-clock time start_time
+static int64_t start_ms = 0;
+static time_t start_time = 0;
+
+// Length of an ACKed lease and of an unanswered OFFER, in seconds
+static uint32_t lease_seconds = 0;
+static uint32_t offer_seconds = 0;
+
+struct worker
+{
+  pthread_t tid;
+  int id;
+  int sock;
+  int epfd;
+  long to_seconds;
+  int batch; // datagrams per recvmmsg/sendmmsg; 1 uses recvfrom/sendto
+  bool uring; // try the io_uring backend first
+};
+
+static struct worker *workers = NULL;
+static int nworkers = 0;
+
+static int64_t
+now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t
+lease_clock (void)
+{
+  return (now_ms () - start_ms) / 1000;
+}
+
+static size_t
+subnet_bucket (struct in_addr giaddr)
 {
-  for (int i = 0; i < MAX_CLIENTS; i++)
+  // Fibonacci hashing spreads consecutive relay addresses
+  return ((uint32_t)giaddr.s_addr * 2654435769U) & subnet_mask;
+}
+
+static bool
+index_subnets (void)
+{
+  size_t nbuckets = 1;
+  while (nbuckets < (size_t)nsubnets * 2)
+    nbuckets <<= 1;
+  subnet_buckets = malloc (nbuckets * sizeof (int32_t));
+  if (subnet_buckets == NULL)
+    return false;
+  memset (subnet_buckets, 0xff, nbuckets * sizeof (int32_t));
+  subnet_mask = nbuckets - 1;
+
+  for (int i = 0; i < nsubnets; i++)
     {
-      leases[i].used = false;
-      leases[i].pending = false;
-      memset (leases[i].chaddr, 0, CHADDR_LEN);
-      leases[i].ip.s_addr = 0;
+      size_t b = subnet_bucket (subnets[i].giaddr);
+      while (subnet_buckets[b] != -1)
+        {
+          if (subnets[subnet_buckets[b]].giaddr.s_addr
+              == subnets[i].giaddr.s_addr)
+            break; // a later duplicate -g is ignored
+          b = (b + 1) & subnet_mask;
+        }
+      if (subnet_buckets[b] == -1)
+        subnet_buckets[b] = i;
     }
+  return true;
 }
 
-static bool
-same_chaddr (const uint8_t *a, const uint8_t *b, int hlen)
+static struct subnet *
+subnet_for (struct in_addr giaddr)
 {
-  for (int i = 0; i < hlen; i++)
+  for (size_t b = subnet_bucket (giaddr); subnet_buckets[b] != -1;
+       b = (b + 1) & subnet_mask)
     {
-      if (a[i] != b[i])
-        return false;
+      struct subnet *subnet = &subnets[subnet_buckets[b]];
+      if (subnet->giaddr.s_addr == giaddr.s_addr)
+        return subnet;
     }
+  return NULL;
+}
 
-  return true;
+// The shard of the client's subnet that holds its lease, or NULL if it
+// came through a relay that has no pool
+static struct lease_shard *
+shard_for (msg_t *msg)
+{
+  struct subnet *subnet = subnet_for (msg->giaddr);
+  if (subnet == NULL)
+    return NULL;
+  return &shards[subnet->first
+                 + lease_store_pick (subnet->store, msg->htype, msg->hlen,
+                                     msg->chaddr)];
 }
 
-static struct lease *
-find_lease (const uint8_t *chaddr, int hlen)
+// Lock the client's shard, first reclaiming leases that have run out.
+// Returns NULL (nothing locked) if the client has no subnet.
+static struct lease_shard *
+lock_shard (msg_t *msg)
 {
-  for (int i = 0; i < MAX_CLIENTS; i++)
+  struct lease_shard *shard = shard_for (msg);
+  if (shard == NULL)
     {
-      if (leases[i].used && same_chaddr (leases[i].chaddr, chaddr, hlen))
+      metrics_count (&metrics_self ()->dropped);
+      if (debug)
         {
-          return &leases[i];
+          char relay[INET_ADDRSTRLEN];
+          inet_ntop (AF_INET, &msg->giaddr, relay, sizeof (relay));
+          fprintf (stderr, "No pool for relay %s\n", relay);
         }
+      return NULL;
     }
+  pthread_mutex_lock (&shard->lock);
+  lease_expire (shard->table, lease_clock ());
+  return shard;
+}
 
-  return NULL;
+// Find or allocate the client's lease in its locked shard. Once the
+// subnet's slots or addresses are used up, tombstones are taken back from
+// the sibling shards one at a time, as lease_assign does within a table.
+// A shard lock is never held while taking another, so the client's shard
+// is unlocked meanwhile and locked again on return.
+static struct lease *
+assign_lease (struct lease_shard *shard, msg_t *msg)
+{
+  struct lease *lease
+      = lease_assign (shard->table, msg->htype, msg->hlen, msg->chaddr);
+  struct subnet *subnet = subnet_for (msg->giaddr);
+  for (int i = 0; lease == NULL && i < subnet->count; i++)
+    {
+      struct lease_shard *sibling = &shards[subnet->first + i];
+      if (sibling == shard)
+        continue;
+      pthread_mutex_unlock (&shard->lock);
+      pthread_mutex_lock (&sibling->lock);
+      bool reclaimed = lease_reclaim (sibling->table);
+      pthread_mutex_unlock (&sibling->lock);
+      pthread_mutex_lock (&shard->lock);
+      if (reclaimed)
+        lease = lease_assign (shard->table, msg->htype, msg->hlen,
+                              msg->chaddr);
+    }
+  return lease;
 }
 
-static struct in_addr
-ip_for_index (int idx)
+// Entry of the shard's reply cache msg's client uses
+static struct cached_reply *
+cache_slot (struct lease_shard *shard, msg_t *msg)
 {
-  struct in_addr addr;
-  uint32_t base = (192U << 24) | (168U << 16) | (1U << 8) | 1U;
-  uint32_t ip = htonl (base + (uint32_t)idx);
-  addr.s_addr = ip;
-  return addr;
+  uint32_t h = lease_key_hash (msg->htype, msg->hlen, msg->chaddr);
+  return &shard->replies[h & (REPLY_CACHE_SIZE - 1)];
 }
 
-static struct lease *
-assign_lease (const uint8_t *chaddr, int hlen)
+static bool
+cache_holds (const struct cached_reply *entry, msg_t *msg)
 {
-  // 1. Reuse existing active lease for this chaddr
-  for (int i = 0; i < MAX_CLIENTS; i++)
+  uint8_t hlen = msg->hlen < CHADDR_LEN ? msg->hlen : CHADDR_LEN;
+  return entry->type != 0 && entry->htype == msg->htype
+         && entry->hlen == hlen
+         && memcmp (entry->chaddr, msg->chaddr, hlen) == 0;
+}
+
+static void
+cache_store (struct cached_reply *entry, msg_t *msg, uint8_t type,
+             uint8_t reply_type, struct in_addr yiaddr, uint64_t lsn)
+{
+  uint8_t hlen = msg->hlen < CHADDR_LEN ? msg->hlen : CHADDR_LEN;
+  entry->xid = msg->xid;
+  entry->type = type;
+  entry->htype = msg->htype;
+  entry->hlen = hlen;
+  entry->reply_type = reply_type;
+  memset (entry->chaddr, 0, CHADDR_LEN);
+  memcpy (entry->chaddr, msg->chaddr, hlen);
+  entry->yiaddr = yiaddr;
+  entry->lsn = lsn;
+}
+
+// Drop whatever is cached for msg's client
+static void
+cache_forget (struct cached_reply *entry, msg_t *msg)
+{
+  if (cache_holds (entry, msg))
+    entry->type = 0;
+}
+
+// Answer a retransmitted request from the cache, as long as the lease it
+// was answered with is still in the state that answer left it in
+static bool
+cache_replay (struct lease_shard *shard, struct cached_reply *entry,
+              msg_t *msg, uint8_t type, struct in_addr *yiaddr,
+              uint8_t *reply_type, uint64_t *commit)
+{
+  if (!cache_holds (entry, msg) || entry->type != type
+      || entry->xid != msg->xid)
+    return false;
+
+  struct lease *lease
+      = lease_find (shard->table, msg->htype, msg->hlen, msg->chaddr);
+  uint8_t state = entry->reply_type == DHCPACK ? LEASE_BOUND : LEASE_OFFERED;
+  if (lease == NULL || lease->state != state
+      || lease->ip.s_addr != entry->yiaddr.s_addr)
+    return false;
+
+  *yiaddr = entry->yiaddr;
+  *reply_type = entry->reply_type;
+  if (entry->lsn > *commit)
+    *commit = entry->lsn;
+  return true;
+}
+
+// Periodic work while the socket is quiet: turn the expiry wheels of the
+// shards no other worker is using right now
+static void
+housekeeping (void)
+{
+  uint64_t now = lease_clock ();
+  for (int i = 0; i < nshards; i++)
     {
-      if (leases[i].used && same_chaddr (leases[i].chaddr, chaddr, hlen))
+      if (pthread_mutex_trylock (&shards[i].lock) != 0)
+        continue;
+      size_t expired = lease_expire (shards[i].table, now);
+      pthread_mutex_unlock (&shards[i].lock);
+      if (debug && expired > 0)
+        fprintf (stderr, "Shard %d: %zu lease(s) expired\n", i, expired);
+    }
+}
+
+// Replies only differ in htype, hlen, xid, chaddr, yiaddr and giaddr once
+// the message type is fixed, so each kind is built once and then patched.
+struct reply_template
+{
+  uint8_t bytes[MAX_DHCP_LENGTH] __attribute__ ((aligned (8)));
+  size_t size;
+};
+
+static struct reply_template offer_template;
+static struct reply_template ack_template;
+static struct reply_template nak_template;
+
+static void
+build_template (struct reply_template *template, uint8_t reply_type)
+{
+  msg_t reply;
+  memset (&reply, 0, sizeof (msg_t));
+  reply.op = BOOTREPLY;
+
+  uint8_t *response = template->bytes;
+  memcpy (response, &reply, sizeof (msg_t));
+  size_t response_size = sizeof (msg_t);
+
+  // next add magic cookie
+  write_cookie (response, &response_size, MAX_DHCP_LENGTH);
+
+  write_option (response, &response_size, MAX_DHCP_LENGTH, DHCP_opt_msgtype,
+                1, &reply_type);
+
+  if (reply_type != DHCPNAK)
+    {
+      uint32_t lease_time = htonl (lease_seconds);
+      write_option (response, &response_size, MAX_DHCP_LENGTH,
+                    DHCP_opt_lease, 4, (uint8_t *)&lease_time);
+    }
+
+  write_option (response, &response_size, MAX_DHCP_LENGTH, DHCP_opt_sid, 4,
+                (uint8_t *)&THIS_SERVER);
+
+  uint8_t end = DHCP_opt_end;
+  write_option (response, &response_size, MAX_DHCP_LENGTH, DHCP_opt_end, 0,
+                &end);
+
+  template->size = response_size;
+}
+
+static void
+build_templates (void)
+{
+  build_template (&offer_template, DHCPOFFER);
+  build_template (&ack_template, DHCPACK);
+  build_template (&nak_template, DHCPNAK);
+}
+
+// Copy the template for reply_type into response and patch in the fields
+// taken from the request. Returns the reply length.
+static size_t
+build_reply (uint8_t *response, msg_t *request, struct in_addr yiaddr,
+             uint8_t reply_type)
+{
+  const struct reply_template *template = &nak_template;
+  if (reply_type == DHCPOFFER)
+    template = &offer_template;
+  else if (reply_type == DHCPACK)
+    template = &ack_template;
+
+  memcpy (response, template->bytes, template->size);
+
+  msg_t *reply = (msg_t *)response;
+  reply->htype = request->htype;
+  reply->hlen = request->hlen;
+  reply->xid = request->xid;
+  reply->yiaddr = yiaddr;
+  reply->giaddr = request->giaddr;
+  memcpy (reply->chaddr, request->chaddr, 16);
+
+  return template->size;
+}
+
+// Count a reply built by build_reply once the kernel has taken it. Its
+// message type is always the first option, right after the cookie.
+static void
+count_sent (struct metrics *metrics, const uint8_t *response)
+{
+  metrics_count (&metrics->sent[response[sizeof (msg_t) + 4 + 2]]);
+}
+
+// Build the reply into response and queue its dump. Returns the reply
+// length.
+static size_t
+make_reply (uint8_t *response, msg_t *request, struct in_addr yiaddr,
+            uint8_t reply_type, struct sockaddr_in *peer)
+{
+  size_t response_size = build_reply (response, request, yiaddr, reply_type);
+  trace (TRACE_BUILD, reply_type);
+  log_packet (LOG_SENT, peer, response, response_size);
+  return response_size;
+}
+
+// Handle one received datagram, writing the reply (if any) to response.
+// Returns the reply length, or 0 when nothing should be sent. *stop is set
+// once the server should stop serving. *commit is raised to the journal
+// LSN that must be durable before the reply is sent.
+static size_t
+handle_packet (uint8_t *buf, int bytes, struct sockaddr_in *peer,
+               uint8_t *response, bool *stop, uint64_t *commit)
+{
+  msg_t *msg = (msg_t *)buf;
+
+  // a client over its rate costs nothing more than the hash of its chaddr
+  if (limiter != NULL
+      && !ratelimit_allow (limiter,
+                           lease_key_hash (msg->htype, msg->hlen, msg->chaddr),
+                           metrics_now ()))
+    {
+      metrics_count (&metrics_self ()->limited);
+      return 0;
+    }
+
+  log_packet (LOG_RECEIVED, peer, buf, bytes);
+
+  uint8_t *options_start = buf + sizeof (msg_t);
+  uint8_t *options_end = buf + bytes - 1;
+
+  struct metrics *metrics = metrics_self ();
+  options_t options;
+  memset (&options, 0, sizeof (options_t));
+  if (!parse_options (options_start, options_end, &options))
+    metrics_count (&metrics->parse_failures);
+
+  uint8_t message_type = 0;
+  if (options.type != NULL)
+    {
+      message_type = *options.type;
+    }
+  metrics_count (
+      &metrics->received[message_type < METRICS_TYPES ? message_type : 0]);
+  trace (TRACE_PARSE, message_type);
+  // fprintf(stderr, "message type is %d\n", message_type);
+
+  // Phase 1: XID == 0
+  if (msg->xid == 0)
+    {
+      struct in_addr yiaddr;
+      inet_pton (AF_INET, "192.168.1.1", &yiaddr);
+
+      uint8_t reply_type;
+      if (message_type == DHCPDISCOVER)
+        {
+          reply_type = DHCPOFFER;
+        }
+      else if (message_type == DHCPREQUEST)
         {
-          return &leases[i];
+          reply_type = DHCPACK;
         }
+      else
+        {
+          reply_type = DHCPNAK;
+        }
+
+      // TODO later
+      *stop = true;
+      return make_reply (response, msg, yiaddr, reply_type, peer);
     }
 
-  // 2. Reuse a tombstone for this chaddr (released, remembers IP)
-  for (int i = 0; i < MAX_CLIENTS; i++)
+  // Phase 2: XID != 0
+
+  // Handle DHCPRELASE
+  if (message_type == DHCPRELEASE)
     {
-      if (!leases[i].used && leases[i].ip.s_addr != 0
-          && same_chaddr (leases[i].chaddr, chaddr, hlen))
-        {
-          leases[i].used = true;
-          leases[i].pending = false;
+      struct lease_shard *shard = lock_shard (msg);
+      if (shard == NULL)
+        return 0;
+      struct lease *lease
+          = lease_find (shard->table, msg->htype, msg->hlen, msg->chaddr);
+      if (lease != NULL)
+        lease_release (shard->table, lease);
+      cache_forget (cache_slot (shard, msg), msg);
+      pthread_mutex_unlock (&shard->lock);
+
+      return 0;
+    }
 
-          return &leases[i];
-        }
+  struct in_addr yiaddr = { 0 };
+  uint8_t reply_type = DHCPNAK; // default
+  struct lease *lease = NULL;
+
+  struct lease_shard *shard = lock_shard (msg);
+  if (shard == NULL)
+    return 0;
+  uint64_t now = lease_clock ();
+
+  // a retransmit gets the same answer again
+  struct cached_reply *cached = cache_slot (shard, msg);
+  bool replay = cache_replay (shard, cached, msg, message_type, &yiaddr,
+                              &reply_type, commit);
+  trace (TRACE_LOOKUP, replay);
+  if (replay)
+    {
+      pthread_mutex_unlock (&shard->lock);
+      metrics_count (&metrics->replayed);
+      return make_reply (response, msg, yiaddr, reply_type, peer);
     }
 
-  // 3. Brand-new lease in an empty slot (never used before)
-  for (int i = 0; i < MAX_CLIENTS; i++)
+  if (message_type == DHCPDISCOVER)
     {
-      if (!leases[i].used && leases[i].ip.s_addr == 0)
+      // reuse or assign a lease
+      lease = assign_lease (shard, msg);
+      trace (TRACE_ALLOC, lease != NULL ? ntohl (lease->ip.s_addr) : 0);
+
+      if (lease == NULL)
         {
-          leases[i].used = true;
-          leases[i].pending = false;
-          memcpy (leases[i].chaddr, chaddr, hlen);
-          leases[i].ip = ip_for_index (i);
-          return &leases[i];
+          // 5th distinct client → NAK, yiaddr stays 0.0.0.0
+          if (debug)
+            fprintf (stderr, "No free leases; sending NAK\n");
+          reply_type = DHCPNAK;
+          metrics_count (&metrics->exhausted);
+          metrics_count (&metrics->naks[NAK_POOL_EXHAUSTED]);
+        }
+      else
+        {
+          // an unanswered offer is reclaimed after offer_seconds, but
+          // never before an existing binding runs out
+          lease_offer (shard->table, lease, now + offer_seconds);
+          yiaddr = lease->ip;
+          reply_type = DHCPOFFER;
+          cache_store (cached, msg, DHCPDISCOVER, DHCPOFFER, yiaddr, 0);
         }
     }
-
-  // 4. No new Ips left: reuse any released lease
-  for (int i = 0; i < MAX_CLIENTS; i++)
+  else if (message_type == DHCPREQUEST)
     {
-      if (!leases[i].used && leases[i].ip.s_addr != 0)
+      struct in_addr req_server_id;
+      struct in_addr req_ip;
+      bool have_sid = false;
+      bool have_reqip = false;
+
+      if (options.sid != NULL)
+        {
+          req_server_id = *options.sid;
+          have_sid = true;
+        }
+
+      if (options.request != NULL)
         {
-          leases[i].used = true;
-          leases[i].pending = false;
-          memcpy (leases[i].chaddr, chaddr, hlen);
-          return &leases[i];
+          req_ip = *options.request;
+          have_reqip = true;
         }
+
+      lease = lease_find (shard->table, msg->htype, msg->hlen, msg->chaddr);
+      trace (TRACE_LOOKUP, lease != NULL);
+
+      int nak = -1; // reason, or -1 if the REQUEST is fine
+
+      if (!have_sid || !have_reqip)
+        nak = NAK_MISSING_OPTION;
+      else if (req_server_id.s_addr != THIS_SERVER.s_addr)
+        nak = NAK_WRONG_SERVER;
+      else if (lease == NULL)
+        nak = NAK_NO_LEASE;
+      else if (lease->state != LEASE_OFFERED)
+        nak = NAK_NOT_OFFERED;
+      else if (req_ip.s_addr != lease->ip.s_addr)
+        nak = NAK_WRONG_ADDRESS;
+
+      if (nak < 0)
+        {
+          yiaddr = lease->ip;
+          reply_type = DHCPACK;
+
+          lease_bind (shard->table, lease, now + lease_seconds);
+          if (lease_table_lsn (shard->table) > *commit)
+            *commit = lease_table_lsn (shard->table);
+          cache_store (cached, msg, DHCPREQUEST, DHCPACK, yiaddr,
+                       lease_table_lsn (shard->table));
+        }
+      else
+        {
+          // mismatch somewhere → NAK, yiaddr remains 0.0.0.0
+          reply_type = DHCPNAK;
+          metrics_count (&metrics->naks[nak]);
+
+          if (lease != NULL)
+            lease_withdraw (shard->table, lease);
+          cache_forget (cached, msg);
+        }
+    }
+  else
+    {
+      // unknown/unsupported type; leave reply_type = NAK
+      if (debug)
+        fprintf (stderr, "Unknown DHCP message type %u\n", message_type);
+      metrics_count (&metrics->naks[NAK_UNKNOWN_TYPE]);
     }
+  pthread_mutex_unlock (&shard->lock);
 
-  // 5. Completely out of space
-  return NULL;
+  // ----- Build Phase 2 response -----
+  // Phase 2 keeps serving until timeout
+  return make_reply (response, msg, yiaddr, reply_type, peer);
 }
 
-int
-setup_server (char *protocol, long to_seconds)
+// Called on every housekeeping tick. Only report idle once the whole
+// server has been quiet for the -s timeout.
+static bool
+server_idle (struct worker *self)
 {
-  inet_pton (AF_INET, "192.168.1.0", &THIS_SERVER);
+  if (self->to_seconds <= 0)
+    return false;
+  int64_t last = __atomic_load_n (&last_activity, __ATOMIC_RELAXED);
+  if (now_ms () - last < self->to_seconds * 1000)
+    return false;
+  if (debug)
+    fprintf (stderr, "Worker %d: receive timeout\n", self->id);
+  return true;
+}
 
-  // UDP socket
-  int sock = socket (AF_INET, SOCK_DGRAM, 0);
-  if (sock < 0)
-    {
-      perror ("socket");
-      return -1;
-    }
+// Tell every worker to finish, waking the ones blocked in epoll_wait
+static void
+stop_workers (void)
+{
+  __atomic_store_n (&stopping, true, __ATOMIC_RELEASE);
+  uint64_t one = 1;
+  if (write (stop_fd, &one, sizeof (one)) < 0)
+    perror ("write");
+}
 
-  // timeout set here
-  struct timeval timeout;
-  timeout.tv_sec = to_seconds;
-  timeout.tv_usec = 0;
-  if (setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout))
-      < 0)
+// Housekeeping tick: stop once the server went idle, expire leases
+// otherwise
+static void
+on_tick (struct worker *self)
+{
+  uint64_t ticks;
+  if (read (timer_fd, &ticks, sizeof (ticks)) < 0)
+    return;
+  if (server_idle (self))
+    stop_workers ();
+  else
+    housekeeping ();
+}
+
+// SIGUSR1 dumps the trace rings (see trace.h); the others stop the server
+static void
+on_signal (void)
+{
+  struct signalfd_siginfo info;
+  if (read (signal_fd, &info, sizeof (info)) < 0)
+    return;
+  if (info.ssi_signo == SIGUSR1)
     {
-      perror ("setsockopt");
-      close (sock);
-      return -1;
+      trace_dump (STDERR_FILENO);
+      return;
     }
+  if (debug)
+    fprintf (stderr, "Caught %s, shutting down\n",
+             strsignal (info.ssi_signo));
+  stop_workers ();
+}
 
-  struct sockaddr_in server_addr;
-  memset (&server_addr, 0, sizeof (server_addr));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = INADDR_ANY;
-  server_addr.sin_port = htons (atoi (protocol));
+// Handle one of worker 0's event sources becoming readable
+static void
+on_event (struct worker *self, int fd)
+{
+  if (fd == timer_fd)
+    on_tick (self);
+  else if (fd == signal_fd)
+    on_signal ();
+  else if (fd == metrics_fd)
+    metrics_scrape (metrics_fd);
+}
 
-  if (bind (sock, (struct sockaddr *)&server_addr, sizeof (server_addr)) < 0)
+// Block until the worker's socket has datagrams queued, handling timer
+// ticks, signals and scrapes meanwhile. Returns false once the worker
+// should stop.
+static bool
+wait_socket (struct worker *self)
+{
+  struct epoll_event events[4];
+  while (!__atomic_load_n (&stopping, __ATOMIC_ACQUIRE))
     {
-      perror ("bind");
-      close (sock);
-      return -1;
-    }
+      int n = epoll_wait (self->epfd, events, 4, -1);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          perror ("epoll_wait");
+          stop_workers ();
+          return false;
+        }
 
-  // initialize leases for phase 2
-  init_leases ();
+      bool readable = false;
+      for (int i = 0; i < n; i++)
+        {
+          int fd = events[i].data.fd;
+          if (fd == self->sock)
+            readable = true;
+          else
+            on_event (self, fd);
+        }
+      if (readable)
+        return !__atomic_load_n (&stopping, __ATOMIC_ACQUIRE);
+    }
+  return false;
+}
 
-  uint8_t buf[MAX_DHCP_LENGTH];
-  struct sockaddr_in client_addr;
-  socklen_t addrlen = sizeof (client_addr);
+// Batched variant of serve: drain up to batch datagrams with one recvmmsg,
+// handle them in order and flush all replies with one sendmmsg.
+static void
+serve_batch (struct worker *self)
+{
+  int batch = self->batch;
+  uint8_t(*bufs)[MAX_DHCP_LENGTH] = calloc (batch, MAX_DHCP_LENGTH);
+  uint8_t(*replies)[MAX_DHCP_LENGTH] = calloc (batch, MAX_DHCP_LENGTH);
+  struct sockaddr_in *addrs = calloc (batch, sizeof (struct sockaddr_in));
+  struct iovec *iovs = calloc (2 * batch, sizeof (struct iovec));
+  struct mmsghdr *in = calloc (batch, sizeof (struct mmsghdr));
+  struct mmsghdr *out = calloc (batch, sizeof (struct mmsghdr));
+  if (bufs == NULL || replies == NULL || addrs == NULL || iovs == NULL
+      || in == NULL || out == NULL)
+    {
+      perror ("calloc");
+      goto done;
+    }
 
-  while (1)
+  for (int i = 0; i < batch; i++)
     {
-      memset (buf, 0, MAX_DHCP_LENGTH);
+      iovs[i].iov_base = bufs[i];
+      iovs[i].iov_len = MAX_DHCP_LENGTH;
+      in[i].msg_hdr.msg_iov = &iovs[i];
+      in[i].msg_hdr.msg_iovlen = 1;
+      in[i].msg_hdr.msg_name = &addrs[i];
+    }
 
-      // getting the message from client
-      int bytes = recvfrom (sock, buf, MAX_DHCP_LENGTH, 0,
-                            (struct sockaddr *)&client_addr, &addrlen);
-      // printf("received %d bytes\n", bytes);
+  int drained = DRAIN_LIMIT;
+  while (!__atomic_load_n (&stopping, __ATOMIC_ACQUIRE))
+    {
+      // go back to epoll once the socket is empty or has had its share
+      if (drained >= DRAIN_LIMIT && !wait_socket (self))
+        break;
+      for (int i = 0; i < batch; i++)
+        in[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_in);
+
+      // take whatever is queued, up to a batch
+      int n = recvmmsg (self->sock, in, batch, 0, NULL);
+      if (n <= 0)
+        {
+          if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            perror ("recvmmsg");
+          drained = DRAIN_LIMIT;
+          continue;
+        }
+      drained = n < batch ? DRAIN_LIMIT : drained % DRAIN_LIMIT + n;
+      trace (TRACE_RECV, n);
+
+      if (__atomic_load_n (&stopping, __ATOMIC_ACQUIRE))
+        break;
+      int64_t received = metrics_now ();
+      __atomic_store_n (&last_activity, received / 1000000, __ATOMIC_RELAXED);
+
+      bool stop = false;
+      uint64_t commit = 0;
+      int nout = 0;
+      for (int i = 0; i < n && !stop; i++)
+        {
+          // the handlers expect unused trailing bytes to be zero
+          int bytes = in[i].msg_len;
+          memset (bufs[i] + bytes, 0, MAX_DHCP_LENGTH - bytes);
+
+          size_t size = handle_packet (bufs[i], bytes, &addrs[i],
+                                       replies[nout], &stop, &commit);
+          if (size == 0)
+            continue;
+
+          struct iovec *iov = &iovs[batch + nout];
+          iov->iov_base = replies[nout];
+          iov->iov_len = size;
+          memset (&out[nout], 0, sizeof (struct mmsghdr));
+          out[nout].msg_hdr.msg_iov = iov;
+          out[nout].msg_hdr.msg_iovlen = 1;
+          out[nout].msg_hdr.msg_name = &addrs[i];
+          out[nout].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+          nout++;
+        }
 
-      if (bytes < 0)
+      // one wait covers every ACK in the batch
+      journal_wait (journal, commit);
+      int sent = 0;
+      while (sent < nout)
         {
-          if (debug)
+          int r = sendmmsg (self->sock, out + sent, nout - sent, 0);
+          if (r <= 0)
             {
-              fprintf (stderr, "Receive timeout\n");
+              perror ("sendmmsg");
+              break;
             }
-          break;
+          sent += r;
+        }
+      trace (TRACE_SEND, sent);
+      struct metrics *metrics = metrics_self ();
+      int64_t latency = metrics_now () - received;
+      for (int i = 0; i < sent; i++)
+        {
+          count_sent (metrics, replies[i]);
+          metrics_latency (metrics, latency);
         }
 
-      fprintf (stdout, "++++++++++++++++++++++++++\n");
-      fprintf (stdout, "SERVER RECEIVED %d BYTES:\n", bytes);
-      fprintf (stdout, "++++++++++++++++++++++++++\n\n");
+      if (stop)
+        {
+          stop_workers ();
+          break;
+        }
+    }
 
-      msg_t *msg = (msg_t *)buf;
+done:
+  free (bufs);
+  free (replies);
+  free (addrs);
+  free (iovs);
+  free (in);
+  free (out);
+}
 
-      dump_msg (stdout, msg, bytes);
-      fprintf (stdout, "\n");
+// Reply to the datagram in receive buffer bid of an io_uring worker. The
+// buffer is only handed back once the reply is sent, since the peer
+// address lives in it; so there is never more than one reply per buffer.
+struct uring_reply
+{
+  int64_t received; // metrics_now () when the request came in
+  struct msghdr hdr;
+  struct iovec iov;
+  uint8_t bytes[MAX_DHCP_LENGTH] __attribute__ ((aligned (8)));
+};
 
-      uint8_t *options_start = buf + sizeof (msg_t);
-      uint8_t *options_end = buf + bytes - 1;
+static bool
+uring_poll (uring_t *ring, int fd)
+{
+  struct io_uring_sqe *sqe = uring_sqe (ring);
+  if (sqe == NULL)
+    return false;
+  uring_prep_poll (sqe, fd, TAG (TAG_POLL, fd));
+  return true;
+}
 
-      options_t options;
-      memset (&options, 0, sizeof (options_t));
-      get_options (options_start, options_end, &options);
+// io_uring variant of serve: one multishot receive fills provided buffers
+// as datagrams arrive; the replies to a round of completions are queued
+// and submitted together with the wait for the next round, so there is
+// one io_uring_enter per round rather than two system calls per packet.
+// Returns false, having served nothing, if the kernel cannot do this.
+static bool
+serve_uring (struct worker *self)
+{
+  uring_t *ring = uring_open (URING_ENTRIES);
+  struct uring_reply *replies = calloc (URING_BUFFERS, sizeof (*replies));
+  uint16_t pending[URING_BUFFERS];
+  if (ring == NULL || replies == NULL
+      || !uring_buffers (ring, URING_BUFFERS, URING_BUFFER_SIZE)
+      || !uring_poll (ring, stop_fd)
+      || (self->id == 0
+          && (!uring_poll (ring, timer_fd) || !uring_poll (ring, signal_fd)
+              || (metrics_fd >= 0 && !uring_poll (ring, metrics_fd)))))
+    {
+      if (debug)
+        perror ("io_uring");
+      uring_close (ring);
+      free (replies);
+      return false;
+    }
 
-      uint8_t message_type = 0;
-      if (options.type != NULL)
+  // the kernel only looks at the name length and control length here
+  struct msghdr recv_hdr;
+  memset (&recv_hdr, 0, sizeof (recv_hdr));
+  recv_hdr.msg_namelen = sizeof (struct sockaddr_in);
+
+  bool armed = false;
+  bool received = false;
+  int held = 0;    // receive buffers not yet handed back
+  int sending = 0; // replies submitted but not completed
+  bool served = true;
+  while (!__atomic_load_n (&stopping, __ATOMIC_ACQUIRE))
+    {
+      // the multishot receive ends when it runs out of buffers (or on an
+      // error); post it again once some are back
+      if (!armed && held < URING_BUFFERS)
         {
-          message_type = *options.type;
+          struct io_uring_sqe *sqe = uring_sqe (ring);
+          if (sqe == NULL)
+            break;
+          uring_prep_recvmsg_multishot (sqe, self->sock, &recv_hdr,
+                                        TAG (TAG_RECV, 0));
+          armed = true;
         }
-      // fprintf(stderr, "message type is %d\n", message_type);
-
-      // Phase 1: XID == 0
-      if (msg->xid == 0)
+      if (uring_submit (ring, 1) < 0 && errno != EINTR)
         {
-          msg_t reply;
-          memset (&reply, 0, sizeof (msg_t));
-
-          reply.op = BOOTREPLY;
-          reply.htype = msg->htype;
-          reply.hlen = msg->hlen;
-          reply.hops = 0;
-          reply.xid = msg->xid;
-          reply.secs = 0;
-          reply.flags = 0;
-
-          memcpy (reply.chaddr, msg->chaddr, 16);
+          perror ("io_uring_enter");
+          stop_workers ();
+          break;
+        }
 
-          inet_pton (AF_INET, "192.168.1.1", &reply.yiaddr);
+      bool stop = false;
+      uint64_t commit = 0;
+      int npending = 0;
+      struct io_uring_cqe *cqe;
+      while (!stop && (cqe = uring_cqe (ring)) != NULL)
+        {
+          uint32_t kind = cqe->user_data >> 32;
+          uint32_t index = (uint32_t)cqe->user_data;
+          int32_t res = cqe->res;
+          uint32_t flags = cqe->flags;
+          uring_cqe_seen (ring);
 
-          // building the response packet
-          uint8_t *response = malloc (sizeof (msg_t));
-          memcpy (response, &reply, sizeof (msg_t));
-          size_t response_size = sizeof (msg_t);
+          if (kind == TAG_POLL)
+            {
+              on_event (self, index);
+              if ((int)index != stop_fd)
+                uring_poll (ring, index);
+              continue;
+            }
 
-          // next add magic cookie
-          response = append_cookie (response, &response_size);
-          // printf("after cookie size = %ld\n", response_size);
+          uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+          if (kind == TAG_SEND)
+            {
+              if (res < 0)
+                fprintf (stderr, "sendmsg: %s\n", strerror (-res));
+              else
+                {
+                  struct metrics *metrics = metrics_self ();
+                  trace (TRACE_SEND, res);
+                  count_sent (metrics, replies[index].bytes);
+                  metrics_latency (metrics,
+                                   metrics_now () - replies[index].received);
+                }
+              uring_buffer_return (ring, index);
+              held--;
+              sending--;
+              continue;
+            }
 
-          uint8_t reply_type;
-          if (message_type == DHCPDISCOVER)
+          if (!(flags & IORING_CQE_F_MORE))
+            armed = false;
+          if (res < 0)
             {
-              reply_type = DHCPOFFER;
+              // an old kernel rejects the receive itself: let the caller
+              // serve from epoll instead
+              if (!received && res == -EINVAL)
+                {
+                  served = false;
+                  break;
+                }
+              if (res != -ENOBUFS)
+                fprintf (stderr, "recvmsg: %s\n", strerror (-res));
+              continue;
             }
-          else if (message_type == DHCPREQUEST)
+          received = true;
+          held++;
+          trace (TRACE_RECV, res);
+
+          // the buffer holds the header, the peer address, then the data
+          uint8_t *buf = uring_buffer (ring, bid);
+          struct io_uring_recvmsg_out *out
+              = (struct io_uring_recvmsg_out *)buf;
+          struct sockaddr_in *peer
+              = (struct sockaddr_in *)(buf + sizeof (*out));
+          uint8_t *data = buf + sizeof (*out) + sizeof (struct sockaddr_in);
+          int bytes = out->payloadlen < MAX_DHCP_LENGTH ? out->payloadlen
+                                                        : MAX_DHCP_LENGTH;
+
+          size_t size = 0;
+          if (!__atomic_load_n (&stopping, __ATOMIC_ACQUIRE))
             {
-              reply_type = DHCPACK;
+              replies[bid].received = metrics_now ();
+              __atomic_store_n (&last_activity,
+                                replies[bid].received / 1000000,
+                                __ATOMIC_RELAXED);
+              // the handlers expect unused trailing bytes to be zero
+              memset (data + bytes, 0, MAX_DHCP_LENGTH - bytes);
+              size = handle_packet (data, bytes, peer, replies[bid].bytes,
+                                    &stop, &commit);
             }
-          else
+          if (size == 0)
             {
-              reply_type = DHCPNAK;
+              uring_buffer_return (ring, bid);
+              held--;
+              continue;
             }
-          response = append_option (response, &response_size, DHCP_opt_msgtype,
-                                    1, &reply_type);
 
-          if (reply_type != DHCPNAK)
+          struct uring_reply *reply = &replies[bid];
+          reply->iov.iov_base = reply->bytes;
+          reply->iov.iov_len = size;
+          memset (&reply->hdr, 0, sizeof (reply->hdr));
+          reply->hdr.msg_iov = &reply->iov;
+          reply->hdr.msg_iovlen = 1;
+          reply->hdr.msg_name = peer;
+          reply->hdr.msg_namelen = sizeof (struct sockaddr_in);
+          pending[npending++] = bid;
+        }
+      if (!served)
+        break;
+
+      // one wait covers every ACK of the round
+      journal_wait (journal, commit);
+      for (int i = 0; i < npending; i++)
+        {
+          struct io_uring_sqe *sqe = uring_sqe (ring);
+          if (sqe == NULL)
             {
-              uint32_t lease_time = htonl (30 * 24 * 60 * 60); // 30 days
-              response
-                  = append_option (response, &response_size, DHCP_opt_lease, 4,
-                                   (uint8_t *)&lease_time);
+              perror ("io_uring");
+              uring_buffer_return (ring, pending[i]);
+              held--;
+              continue;
             }
+          uring_prep_sendmsg (sqe, self->sock, &replies[pending[i]].hdr,
+                              TAG (TAG_SEND, pending[i]));
+          sending++;
+        }
 
-          response = append_option (response, &response_size, DHCP_opt_sid, 4,
-                                    (uint8_t *)&THIS_SERVER);
+      if (stop)
+        stop_workers ();
+    }
 
-          uint8_t end = DHCP_opt_end;
-          response = append_option (response, &response_size, DHCP_opt_end, 0,
-                                    &end);
+  // closing the ring would cancel replies still in flight
+  while (sending > 0 && uring_submit (ring, 1) >= 0)
+    {
+      struct io_uring_cqe *cqe;
+      while ((cqe = uring_cqe (ring)) != NULL)
+        {
+          if (cqe->user_data >> 32 == TAG_SEND)
+            sending--;
+          uring_cqe_seen (ring);
+        }
+    }
 
-          fprintf (stdout, "+++++++++++++++++++++++++\n");
-          fprintf (stdout, "SERVER SENDING %ld BYTES:\n", response_size);
-          fprintf (stdout, "+++++++++++++++++++++++++\n\n");
+  if (debug && !served)
+    fprintf (stderr, "Worker %d: no multishot receive, using epoll\n",
+             self->id);
+  uring_close (ring);
+  free (replies);
+  return served;
+}
 
-          dump_msg (stdout, (msg_t *)response, response_size);
+// Worker thread body: every worker waits on the shared socket in its own
+// epoll set, and the kernel hands each datagram to exactly one of them.
+static void *
+serve (void *arg)
+{
+  struct worker *self = (struct worker *)arg;
 
-          sendto (sock, response, response_size, 0,
-                  (struct sockaddr *)&client_addr, addrlen);
+  if (self->uring && serve_uring (self))
+    return NULL;
+  if (self->batch > 1)
+    {
+      serve_batch (self);
+      return NULL;
+    }
 
-          free (response);
-          free_options (&options);
+  uint8_t buf[MAX_DHCP_LENGTH] __attribute__ ((aligned (8)));
+  uint8_t response[MAX_DHCP_LENGTH] __attribute__ ((aligned (8)));
+  struct sockaddr_in client_addr;
+  socklen_t addrlen;
 
-          // TODO later
-          break;
-        }
+  int drained = DRAIN_LIMIT;
+  while (!__atomic_load_n (&stopping, __ATOMIC_ACQUIRE))
+    {
+      // go back to epoll once the socket is empty or has had its share
+      if (drained >= DRAIN_LIMIT && !wait_socket (self))
+        break;
+      memset (buf, 0, MAX_DHCP_LENGTH);
+      addrlen = sizeof (client_addr);
 
-      else // Phase 2: XID != 0
+      // getting the message from client
+      int bytes = recvfrom (self->sock, buf, MAX_DHCP_LENGTH, 0,
+                            (struct sockaddr *)&client_addr, &addrlen);
+      // printf("received %d bytes\n", bytes);
+
+      if (bytes < 0)
+        {
+          if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror ("recvfrom");
+          drained = DRAIN_LIMIT;
+          continue;
+        }
+      drained = drained % DRAIN_LIMIT + 1;
+      trace (TRACE_RECV, bytes);
+
+      if (__atomic_load_n (&stopping, __ATOMIC_ACQUIRE))
+        break;
+      int64_t received = metrics_now ();
+      __atomic_store_n (&last_activity, received / 1000000, __ATOMIC_RELAXED);
+
+      bool stop = false;
+      uint64_t commit = 0;
+      size_t size = handle_packet (buf, bytes, &client_addr, response, &stop,
+                                   &commit);
+      journal_wait (journal, commit);
+      if (size > 0
+          && sendto (self->sock, response, size, 0,
+                     (struct sockaddr *)&client_addr, addrlen)
+                 >= 0)
         {
+          struct metrics *metrics = metrics_self ();
+          trace (TRACE_SEND, size);
+          count_sent (metrics, response);
+          metrics_latency (metrics, metrics_now () - received);
+        }
 
-          // Handle DHCPRELASE
-          if (message_type == DHCPRELEASE)
-            {
-              struct lease *lease = find_lease (msg->chaddr, msg->hlen);
-              if (lease != NULL)
-                {
-                  lease->used = false;
-                  lease->pending = false;
-                }
+      if (stop)
+        {
+          stop_workers ();
+          break;
+        }
+    }
 
-              free_options (&options);
-              continue;
-            }
+  return NULL;
+}
 
-          msg_t reply;
-          memset (&reply, 0, sizeof (msg_t));
+// Open and bind a non-blocking UDP socket. With reuseport set, several
+// sockets can bind the same port and the kernel spreads incoming flows
+// across them.
+static int
+open_socket (char *protocol, bool reuseport)
+{
+  // UDP socket
+  int sock = socket (AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (sock < 0)
+    {
+      perror ("socket");
+      return -1;
+    }
 
-          reply.op = BOOTREPLY;
-          reply.htype = msg->htype;
-          reply.hlen = msg->hlen;
-          reply.hops = 0;
-          reply.xid = msg->xid;
-          reply.secs = 0;
-          reply.flags = 0;
+  int on = 1;
+  if (reuseport
+      && setsockopt (sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on)) < 0)
+    {
+      perror ("setsockopt");
+      close (sock);
+      return -1;
+    }
 
-          memcpy (reply.chaddr, msg->chaddr, 16);
+  struct sockaddr_in server_addr;
+  memset (&server_addr, 0, sizeof (server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = INADDR_ANY;
+  server_addr.sin_port = htons (atoi (protocol));
 
-          uint8_t reply_type = DHCPNAK; // default
-          struct lease *lease = NULL;
+  if (bind (sock, (struct sockaddr *)&server_addr, sizeof (server_addr)) < 0)
+    {
+      perror ("bind");
+      close (sock);
+      return -1;
+    }
 
-          if (message_type == DHCPDISCOVER)
-            {
-              // reuse or assign a lease
-              lease = assign_lease (msg->chaddr, msg->hlen);
+  return sock;
+}
 
-              if (lease == NULL)
-                {
-                  // 5th distinct client → NAK, yiaddr stays 0.0.0.0
-                  if (debug)
-                    fprintf (stderr, "No free leases; sending NAK\n");
-                  reply_type = DHCPNAK;
-                }
-              else
-                {
-                  lease->pending = true;
-                  reply.yiaddr = lease->ip;
-                  reply_type = DHCPOFFER;
-                }
-            }
-          else if (message_type == DHCPREQUEST)
-            {
-              struct in_addr req_server_id;
-              struct in_addr req_ip;
-              bool have_sid = false;
-              bool have_reqip = false;
+static bool
+watch (int epfd, int fd, uint32_t events)
+{
+  struct epoll_event ev;
+  memset (&ev, 0, sizeof (ev));
+  ev.events = events;
+  ev.data.fd = fd;
+  return epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
 
-              if (options.sid != NULL)
-                {
-                  req_server_id = *options.sid;
-                  have_sid = true;
-                }
+static void
+close_events (void)
+{
+  for (int i = 0; i < nworkers; i++)
+    {
+      if (workers[i].epfd >= 0)
+        close (workers[i].epfd);
+      workers[i].epfd = -1;
+    }
+  if (stop_fd >= 0)
+    close (stop_fd);
+  if (timer_fd >= 0)
+    close (timer_fd);
+  if (signal_fd >= 0)
+    close (signal_fd);
+  stop_fd = timer_fd = signal_fd = -1;
+  metrics_close (metrics_fd, metrics_path);
+  metrics_fd = -1;
+  pthread_sigmask (SIG_SETMASK, &old_sigmask, NULL);
+}
 
-              if (options.request != NULL)
-                {
-                  req_ip = *options.request;
-                  have_reqip = true;
-                }
+// Create the shared event sources, ticking every tick_ms and serving
+// metrics on path unless it is NULL, and an epoll set for every worker.
+// Must run before any thread is started (the workers, the logging thread
+// and the journal's flusher) so that they all inherit the blocked signals.
+static bool
+open_events (long tick_ms, const char *path)
+{
+  sigset_t mask;
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGINT);
+  sigaddset (&mask, SIGTERM);
+  sigaddset (&mask, SIGUSR1);
+  pthread_sigmask (SIG_BLOCK, &mask, &old_sigmask);
+
+  struct itimerspec tick;
+  tick.it_interval.tv_sec = tick_ms / 1000;
+  tick.it_interval.tv_nsec = (tick_ms % 1000) * 1000000;
+  tick.it_value = tick.it_interval;
+
+  stop_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  signal_fd = signalfd (-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+  bool ok = stop_fd >= 0 && timer_fd >= 0 && signal_fd >= 0
+            && timerfd_settime (timer_fd, 0, &tick, NULL) == 0;
+  if (ok && path != NULL)
+    {
+      metrics_fd = metrics_listen (path);
+      metrics_path = path;
+      if (metrics_fd < 0) // explained by metrics_listen
+        {
+          close_events ();
+          return false;
+        }
+    }
 
-              lease = find_lease (msg->chaddr, msg->hlen);
+  // workers sharing a socket take turns being woken for it
+  for (int i = 0; ok && i < nworkers; i++)
+    {
+      workers[i].epfd = epoll_create1 (EPOLL_CLOEXEC);
+      ok = workers[i].epfd >= 0
+           && watch (workers[i].epfd, workers[i].sock,
+                     EPOLLIN | EPOLLEXCLUSIVE)
+           && watch (workers[i].epfd, stop_fd, EPOLLIN)
+           && (i > 0
+               || (watch (workers[i].epfd, timer_fd, EPOLLIN)
+                   && watch (workers[i].epfd, signal_fd, EPOLLIN)
+                   && (metrics_fd < 0
+                       || watch (workers[i].epfd, metrics_fd, EPOLLIN))));
+    }
 
-              bool ok = true;
+  if (!ok)
+    {
+      perror ("open_events");
+      close_events ();
+    }
+  return ok;
+}
 
-              if (!have_sid || !have_reqip)
-                ok = false;
-              else if (req_server_id.s_addr != THIS_SERVER.s_addr)
-                ok = false;
-              else if (lease == NULL)
-                ok = false;
-              else if (!lease->pending)
-                ok = false;
-              else if (req_ip.s_addr != lease->ip.s_addr)
-                ok = false;
+static void
+destroy_shards (void)
+{
+  for (int i = 0; i < nshards; i++)
+    {
+      free (shards[i].replies);
+      pthread_mutex_destroy (&shards[i].lock);
+    }
+  free (shards);
+  shards = NULL;
+  nshards = 0;
+  for (int i = 0; subnets != NULL && i < nsubnets; i++)
+    {
+      lease_store_destroy (subnets[i].store);
+      pool_destroy (subnets[i].pool);
+    }
+  free (subnets);
+  subnets = NULL;
+  nsubnets = 0;
+  free (subnet_buckets);
+  subnet_buckets = NULL;
+  ratelimit_destroy (limiter);
+  limiter = NULL;
+  journal_close (journal);
+  journal = NULL;
+  lease_db_close (lease_db);
+  lease_db = NULL;
+}
 
-              if (ok)
-                {
-                  reply.yiaddr = lease->ip;
-                  reply_type = DHCPACK;
+// Create the pool and store of subnet, with slots for its leases, and
+// its shards, appended to shards[]. The store's records follow on from
+// *records.
+static bool
+add_shards (struct server_config *config, struct subnet *subnet,
+            relay_pool_t pool, long slots, struct lease_record **records,
+            size_t *restored)
+{
+  subnet->pool = pool_create (pool.first, pool.count);
+  if (subnet->pool == NULL)
+    return false;
+  for (int x = 0; x < config->nexcludes; x++)
+    pool_exclude (subnet->pool, config->excludes[x].lo,
+                  config->excludes[x].hi);
+  // neither the server nor the relay can be handed out
+  pool_exclude (subnet->pool, ntohl (THIS_SERVER.s_addr),
+                ntohl (THIS_SERVER.s_addr));
+  if (pool.giaddr != 0)
+    pool_exclude (subnet->pool, pool.giaddr, pool.giaddr);
+
+  subnet->store = lease_store_create (slots, subnet->pool, subnet->count);
+  if (subnet->store == NULL)
+    return false;
+  if (lease_db != NULL)
+    {
+      *restored += lease_store_attach (subnet->store, *records, start_time);
+      if (journal != NULL)
+        lease_store_journal (subnet->store, journal,
+                             *records - lease_db_records (lease_db));
+      *records += slots;
+    }
 
-                  lease->pending = false;
-                  lease->used = true;
-                }
-              else
-                {
-                  // mismatch somewhere → NAK, yiaddr remains 0.0.0.0
-                  reply_type = DHCPNAK;
+  for (int i = 0; i < subnet->count; i++)
+    {
+      struct lease_shard *shard = &shards[nshards++];
+      pthread_mutex_init (&shard->lock, NULL);
+      shard->table = lease_store_table (subnet->store, i);
+      shard->replies
+          = calloc (REPLY_CACHE_SIZE, sizeof (struct cached_reply));
+      if (shard->replies == NULL)
+        return false;
+    }
+  return true;
+}
 
-                  if (lease != NULL)
-                    lease->pending = false;
-                }
-            }
-          else
-            {
-              // unknown/unsupported type; leave reply_type = NAK
-              if (debug)
-                fprintf (stderr, "Unknown DHCP message type %u\n",
-                         message_type);
-            }
+// Address range and slot count of subnet i; 0 is the local one
+static relay_pool_t
+subnet_pool (struct server_config *config, int i, long *slots)
+{
+  if (i > 0)
+    {
+      *slots = config->relays[i - 1].count;
+      return config->relays[i - 1];
+    }
+  relay_pool_t local = { 0, config->pool_first, config->pool_count };
+  *slots = config->max_clients;
+  return local;
+}
 
-          // ----- Build and send Phase 2 response -----
-          uint8_t *response = malloc (sizeof (msg_t));
-          memcpy (response, &reply, sizeof (msg_t));
-          size_t response_size = sizeof (msg_t);
+// Set up the local subnet (giaddr 0.0.0.0) with max_clients slots and one
+// subnet per relay with a slot per address. Each subnet is split into
+// (at most) count shards.
+static bool
+init_shards (struct server_config *config, int count)
+{
+  nsubnets = 1 + config->nrelays;
+  subnets = calloc (nsubnets, sizeof (struct subnet));
+  if (subnets == NULL)
+    return false;
+
+  int total = 0;
+  long slots = 0;
+  for (int i = 0; i < nsubnets; i++)
+    {
+      long n;
+      relay_pool_t pool = subnet_pool (config, i, &n);
+      subnets[i].giaddr.s_addr = htonl (pool.giaddr);
+      subnets[i].first = total;
+      subnets[i].count = count;
+      if (subnets[i].count > n)
+        subnets[i].count = n;
+      if (subnets[i].count > (long)pool.count)
+        subnets[i].count = pool.count;
+      total += subnets[i].count;
+      slots += n;
+    }
+  shards = calloc (total, sizeof (struct lease_shard));
+  if (shards == NULL || !index_subnets ())
+    {
+      destroy_shards ();
+      return false;
+    }
 
-          response = append_cookie (response, &response_size);
+  struct in_addr first_ip = { htonl (config->pool_first) };
+  if (config->db_path != NULL)
+    {
+      lease_db = lease_db_open (config->db_path, slots, nsubnets, first_ip);
+      if (lease_db == NULL)
+        {
+          if (errno != EINVAL) // a mismatch is explained already
+            perror (config->db_path);
+          destroy_shards ();
+          return false;
+        }
+    }
 
-          response = append_option (response, &response_size, DHCP_opt_msgtype,
-                                    1, &reply_type);
+  // bring the database up to date before the tables load it
+  long replayed = 0;
+  if (config->journal_path != NULL)
+    {
+      replayed = journal_replay (config->journal_path, lease_db);
+      if (replayed >= 0)
+        journal = journal_open (config->journal_path, lease_db,
+                                config->commit_ms, config->commit_batch);
+      if (journal == NULL)
+        {
+          perror (config->journal_path);
+          destroy_shards ();
+          return false;
+        }
+    }
 
-          if (reply_type != DHCPNAK)
-            {
-              uint32_t lease_time = htonl (30 * 24 * 60 * 60); // 30 days
-              response
-                  = append_option (response, &response_size, DHCP_opt_lease, 4,
-                                   (uint8_t *)&lease_time);
-            }
-          response = append_option (response, &response_size, DHCP_opt_sid, 4,
-                                    (uint8_t *)&THIS_SERVER);
+  struct lease_record *records
+      = lease_db != NULL ? lease_db_records (lease_db) : NULL;
+  size_t restored = 0;
+  for (int i = 0; i < nsubnets; i++)
+    {
+      long n;
+      relay_pool_t pool = subnet_pool (config, i, &n);
+      if (!add_shards (config, &subnets[i], pool, n, &records, &restored))
+        {
+          destroy_shards ();
+          return false;
+        }
+    }
 
-          uint8_t end = DHCP_opt_end;
-          response = append_option (response, &response_size, DHCP_opt_end, 0,
-                                    &end);
+  if (config->rate_limit > 0)
+    {
+      limiter = ratelimit_create (config->rate_limit, config->rate_burst);
+      if (limiter == NULL)
+        {
+          perror ("ratelimit_create");
+          destroy_shards ();
+          return false;
+        }
+    }
 
-          fprintf (stdout, "+++++++++++++++++++++++++\n");
-          fprintf (stdout, "SERVER SENDING %ld BYTES:\n", response_size);
-          fprintf (stdout, "+++++++++++++++++++++++++\n\n");
+  if (debug && lease_db != NULL)
+    fprintf (stderr, "Restored %zu lease(s)%s, %ld journal entries\n",
+             restored,
+             lease_db_recovered (lease_db) ? " after an unclean shutdown" : "",
+             replayed);
+  return true;
+}
 
-          dump_msg (stdout, (msg_t *)response, response_size);
+int
+setup_server (char *protocol, struct server_config *config)
+{
+  inet_pton (AF_INET, "192.168.1.0", &THIS_SERVER);
+  start_ms = now_ms ();
+  start_time = time (NULL);
+  lease_seconds = config->lease_seconds;
+  offer_seconds = config->offer_seconds;
+  build_templates ();
+
+  // housekeeping runs every IDLE_TICK_MS, or every -s timeout if that is
+  // shorter, and checks whether the server as a whole has gone idle
+  long tick_ms = config->to_seconds * 1000;
+  if (tick_ms <= 0 || tick_ms > IDLE_TICK_MS)
+    tick_ms = IDLE_TICK_MS;
+
+  nworkers = config->threads > 0 ? config->threads : 1;
+  workers = calloc (nworkers, sizeof (struct worker));
+  if (workers == NULL)
+    {
+      perror ("calloc");
+      return -1;
+    }
 
-          sendto (sock, response, response_size, 0,
-                  (struct sockaddr *)&client_addr, addrlen);
+  // sharded mode: one SO_REUSEPORT socket per worker; otherwise every
+  // worker shares a single socket
+  int opened = 0;
+  for (int i = 0; i < nworkers; i++)
+    {
+      workers[i].id = i;
+      workers[i].epfd = -1;
+      workers[i].to_seconds = config->to_seconds;
+      workers[i].batch = config->batch;
+      workers[i].uring = config->uring;
+      if (i == 0 || config->reuseport)
+        {
+          workers[i].sock = open_socket (protocol, config->reuseport);
+          if (workers[i].sock < 0)
+            break;
+          opened++;
+        }
+      else
+        workers[i].sock = workers[0].sock;
+    }
 
-          free (response);
-          free_options (&options);
-          // Phase 2 keeps serving until timeout
+  // initialize leases for phase 2, once the signals are blocked: the
+  // journal's flusher thread must inherit the mask like the workers
+  int sock = workers[0].sock;
+  bool events = opened == (config->reuseport ? nworkers : 1)
+                && open_events (tick_ms, config->metrics_path);
+  if (!events || !init_shards (config, config->reuseport ? nworkers : 1))
+    {
+      if (events && errno != EINVAL) // not a lease database mismatch
+        fprintf (stderr, "Cannot allocate %ld leases\n", config->max_clients);
+      if (events)
+        close_events ();
+      for (int i = 0; i < opened; i++)
+        close (workers[i].sock);
+      free (workers);
+      workers = NULL;
+      return -1;
+    }
+  if (!log_start (config->verbosity, config->pcap_path, atoi (protocol),
+                  LOG_RING_SIZE))
+    {
+      perror ("log_start");
+      close_events ();
+      for (int i = 0; i < opened; i++)
+        close (workers[i].sock);
+      free (workers);
+      workers = NULL;
+      destroy_shards ();
+      return -1;
+    }
+  stopping = false;
+  last_activity = now_ms ();
+  trace_install ();
+
+  // worker 0 runs on the calling thread; the rest get their own. Sharded
+  // workers are pinned round-robin to the online CPUs.
+  long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+  int started = 1;
+  for (int i = 1; i < nworkers; i++)
+    {
+      if (pthread_create (&workers[i].tid, NULL, serve, &workers[i]) != 0)
+        {
+          perror ("pthread_create");
+          break;
         }
+      started++;
+    }
+  workers[0].tid = pthread_self ();
+  if (config->reuseport && ncpus > 0)
+    {
+      for (int i = 0; i < started; i++)
+        {
+          cpu_set_t cpus;
+          CPU_ZERO (&cpus);
+          CPU_SET (i % ncpus, &cpus);
+          pthread_setaffinity_np (workers[i].tid, sizeof (cpus), &cpus);
+        }
+    }
+  if (debug)
+    fprintf (stderr, "Serving with %d worker(s), %d lease shard(s)\n",
+             started, nshards);
+
+  serve (&workers[0]);
+
+  for (int i = 1; i < started; i++)
+    pthread_join (workers[i].tid, NULL);
+  log_stop ();
+  close_events ();
+
+  for (int i = 0; i < nworkers; i++)
+    {
+      if (i == 0 || config->reuseport)
+        close (workers[i].sock);
     }
-  close (sock);
+  free (workers);
+  workers = NULL;
+  destroy_shards ();
   return sock;
 }
@@ -6,7 +6,51 @@
 
 #include "dhcp.h"
 
-int setup_server (char *, long to_seconds);
+// An inclusive address range, host byte order
+typedef struct
+{
+  uint32_t lo;
+  uint32_t hi;
+} addr_range_t;
+
+// Addresses for the clients behind one relay agent (-g), host byte order
+typedef struct
+{
+  uint32_t giaddr;
+  uint32_t first;
+  uint32_t count;
+} relay_pool_t;
+
+// Runtime settings gathered from the command line
+struct server_config
+{
+  long to_seconds;        // idle receive timeout before shutting down
+  int threads;            // number of worker threads sharing the socket
+  long max_clients;       // number of lease slots to manage
+  uint32_t pool_first;    // first address handed out, host byte order
+  uint32_t pool_count;    // size of the address range (-n)
+  addr_range_t *excludes; // addresses never handed out (-x)
+  int nexcludes;          // entries in excludes
+  relay_pool_t *relays;   // per-relay pools (-g)
+  int nrelays;            // entries in relays
+  int batch;              // datagrams moved per recvmmsg/sendmmsg call
+  bool reuseport;         // one SO_REUSEPORT socket and lease shard per worker
+  double rate_limit;      // per-client packets per second (-R), 0 for no limit
+  double rate_burst;      // packets a client may send back to back (-R)
+  bool uring;             // serve through io_uring when the kernel can (-u)
+  long lease_seconds;     // lease time handed out in every ACK
+  long offer_seconds;     // how long an unanswered OFFER holds its address
+  int verbosity;          // LOG_QUIET or LOG_PACKETS (see log.h)
+  char *pcap_path;        // capture all traffic to this pcapng file, or NULL
+  char *metrics_path;     // serve counters on this Unix socket (-m), or NULL
+  char *decode_path;      // print this capture instead of serving (-P)
+  char *db_path;          // persistent lease database (see leasedb.h), or NULL
+  char *journal_path;     // write-ahead journal for db_path (see journal.h)
+  long commit_ms;         // longest a journal entry waits for its group commit
+  long commit_batch;      // journal entries that trigger a group commit
+};
+
+int setup_server (char *, struct server_config *);
 
 extern bool debug;
 extern struct in_addr THIS_SERVER;
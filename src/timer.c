@@ -0,0 +1,145 @@
+#include <stddef.h>
+
+#include "timer.h"
+
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+
+static void
+list_init (struct timer_node *head)
+{
+  head->next = head;
+  head->prev = head;
+}
+
+static void
+list_add (struct timer_node *head, struct timer_node *node)
+{
+  node->prev = head->prev;
+  node->next = head;
+  head->prev->next = node;
+  head->prev = node;
+}
+
+static void
+list_del (struct timer_node *node)
+{
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->next = NULL;
+  node->prev = NULL;
+}
+
+// Pick the slot for node based on how far in the future it expires
+static void
+place (timer_wheel_t *wheel, struct timer_node *node)
+{
+  uint64_t expires = node->expires;
+  if (expires < wheel->now)
+    expires = wheel->now;
+  uint64_t delta = expires - wheel->now;
+
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1
+         && delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+    level++;
+
+  // beyond the top level's reach: park in its furthest slot and let the
+  // node cascade again when that slot comes around
+  uint64_t span = 1ULL << (WHEEL_BITS * WHEEL_LEVELS);
+  if (delta >= span)
+    expires = wheel->now + span - 1;
+
+  size_t slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+  list_add (&wheel->slots[level][slot], node);
+}
+
+void
+timer_wheel_init (timer_wheel_t *wheel, uint64_t now)
+{
+  wheel->now = now;
+  for (int level = 0; level < WHEEL_LEVELS; level++)
+    for (int slot = 0; slot < WHEEL_SIZE; slot++)
+      list_init (&wheel->slots[level][slot]);
+}
+
+void
+timer_node_init (struct timer_node *node)
+{
+  node->next = NULL;
+  node->prev = NULL;
+  node->expires = 0;
+}
+
+bool
+timer_pending (const struct timer_node *node)
+{
+  return node->next != NULL;
+}
+
+void
+timer_schedule (timer_wheel_t *wheel, struct timer_node *node,
+                uint64_t expires)
+{
+  if (timer_pending (node))
+    list_del (node);
+  node->expires = expires;
+  place (wheel, node);
+}
+
+void
+timer_cancel (struct timer_node *node)
+{
+  if (timer_pending (node))
+    list_del (node);
+}
+
+// Re-place every node of one higher-level slot into the levels below
+static void
+cascade (timer_wheel_t *wheel, int level, size_t slot)
+{
+  struct timer_node pending;
+  struct timer_node *head = &wheel->slots[level][slot];
+
+  // detach the whole list first since place may add to the same slot
+  list_init (&pending);
+  if (head->next != head)
+    {
+      pending.next = head->next;
+      pending.prev = head->prev;
+      pending.next->prev = &pending;
+      pending.prev->next = &pending;
+      list_init (head);
+    }
+
+  while (pending.next != &pending)
+    {
+      struct timer_node *node = pending.next;
+      list_del (node);
+      place (wheel, node);
+    }
+}
+
+void
+timer_advance (timer_wheel_t *wheel, uint64_t now, timer_fn fire, void *arg)
+{
+  while (wheel->now <= now)
+    {
+      size_t slot = wheel->now & WHEEL_MASK;
+
+      // entering a new lap of a level: pull its next slot down
+      for (int level = 1; slot == 0 && level < WHEEL_LEVELS; level++)
+        {
+          slot = (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+          cascade (wheel, level, slot);
+        }
+
+      struct timer_node *head = &wheel->slots[0][wheel->now & WHEEL_MASK];
+      wheel->now++;
+      while (head->next != head)
+        {
+          struct timer_node *node = head->next;
+          list_del (node);
+          fire (node, arg);
+        }
+    }
+}
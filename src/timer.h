@@ -0,0 +1,52 @@
+#ifndef __cs361_timer_h__
+#define __cs361_timer_h__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel with a one-tick resolution. Level 0 has one
+// slot per tick; every higher level has slots WHEEL_SIZE times wider, and
+// its timers cascade down a level as the wheel turns. Scheduling and
+// cancelling are O(1) and advancing costs O(1) per elapsed tick plus the
+// timers that fire or cascade.
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+// Intrusive list node; embed one in each object that needs a deadline
+struct timer_node
+{
+  struct timer_node *next;
+  struct timer_node *prev;
+  uint64_t expires;
+};
+
+typedef struct
+{
+  uint64_t now; // next tick to process
+  struct timer_node slots[WHEEL_LEVELS][WHEEL_SIZE];
+} timer_wheel_t;
+
+typedef void (*timer_fn) (struct timer_node *, void *);
+
+// Start an empty wheel at tick now
+void timer_wheel_init (timer_wheel_t *wheel, uint64_t now);
+
+// Prepare a node that is not scheduled
+void timer_node_init (struct timer_node *node);
+
+bool timer_pending (const struct timer_node *node);
+
+// (Re)schedule node to fire at tick expires
+void timer_schedule (timer_wheel_t *wheel, struct timer_node *node,
+                     uint64_t expires);
+
+void timer_cancel (struct timer_node *node);
+
+// Turn the wheel up to and including tick now, calling fire for every
+// expired node (already unlinked, so fire may reschedule it)
+void timer_advance (timer_wheel_t *wheel, uint64_t now, timer_fn fire,
+                    void *arg);
+
+#endif
@@ -0,0 +1,177 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_THREADS 1024
+
+__thread struct trace_ring *trace_self = NULL;
+
+// Rings of every thread that traced something; once the table is full,
+// later threads share the spare ring
+static struct trace_ring *rings[TRACE_THREADS];
+static int nrings = 0;
+static struct trace_ring spare;
+
+// A stamp and the monotonic time taken together, to convert stamps to ns
+static uint64_t base_stamp = 0;
+static uint64_t base_ns = 0;
+
+static const char *event_names[TRACE_EVENTS] = {
+  "recv", "parse", "lookup", "alloc", "build", "send",
+};
+
+struct trace_ring *
+trace_ring (void)
+{
+  int i = __atomic_fetch_add (&nrings, 1, __ATOMIC_RELAXED);
+  struct trace_ring *ring = NULL;
+  if (i < TRACE_THREADS)
+    ring = calloc (1, sizeof (struct trace_ring));
+  if (ring != NULL)
+    __atomic_store_n (&rings[i], ring, __ATOMIC_RELEASE);
+  else
+    ring = &spare;
+  trace_self = ring;
+  return ring;
+}
+
+static uint64_t
+monotonic_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// printf is not async-signal-safe, so a dump formats its own lines
+struct line
+{
+  char text[128];
+  size_t len;
+};
+
+static void
+put_str (struct line *line, const char *str)
+{
+  while (*str != '\0' && line->len < sizeof (line->text))
+    line->text[line->len++] = *str++;
+}
+
+// value in decimal, right-aligned in width columns
+static void
+put_uint (struct line *line, uint64_t value, size_t width)
+{
+  char digits[20];
+  size_t n = 0;
+  do
+    {
+      digits[n++] = '0' + value % 10;
+      value /= 10;
+    }
+  while (value > 0);
+  for (; width > n && line->len < sizeof (line->text); width--)
+    line->text[line->len++] = ' ';
+  while (n > 0 && line->len < sizeof (line->text))
+    line->text[line->len++] = digits[--n];
+}
+
+static void
+flush (int fd, struct line *line)
+{
+  put_str (line, "\n");
+  if (write (fd, line->text, line->len) < 0)
+    return;
+  line->len = 0;
+}
+
+static void
+dump_ring (int fd, int index, const struct trace_ring *ring,
+           uint64_t now_stamp, double ns_per_tick)
+{
+  uint64_t next = __atomic_load_n (&ring->next, __ATOMIC_ACQUIRE);
+  uint64_t first = next > TRACE_RING_SIZE ? next - TRACE_RING_SIZE : 0;
+
+  struct line line = { .len = 0 };
+  put_str (&line, "trace: thread ");
+  put_uint (&line, index, 0);
+  put_str (&line, ", last ");
+  put_uint (&line, next - first, 0);
+  put_str (&line, " of ");
+  put_uint (&line, next, 0);
+  put_str (&line, " points (ns before the dump, ns since the previous)");
+  flush (fd, &line);
+
+  uint64_t previous = 0;
+  for (uint64_t i = first; i < next; i++)
+    {
+      const struct trace_point *point = &ring->points[i % TRACE_RING_SIZE];
+      uint64_t stamp = point->stamp;
+      uint64_t ago = now_stamp > stamp ? now_stamp - stamp : 0;
+      put_uint (&line, ago * ns_per_tick, 14);
+      put_str (&line, i == first ? "          " : " +");
+      if (i > first)
+        put_uint (&line, stamp > previous ? (stamp - previous) * ns_per_tick
+                                          : 0,
+                  8);
+      put_str (&line, "  ");
+      put_str (&line, point->event < TRACE_EVENTS
+                          ? event_names[point->event]
+                          : "?");
+      put_str (&line, " ");
+      put_uint (&line, point->arg, 0);
+      flush (fd, &line);
+      previous = stamp;
+    }
+}
+
+void
+trace_dump (int fd)
+{
+  uint64_t now_stamp = trace_stamp ();
+  uint64_t now_ns = monotonic_ns ();
+  double ns_per_tick = 1;
+  if (base_ns != 0 && now_ns > base_ns && now_stamp > base_stamp)
+    ns_per_tick = (double)(now_ns - base_ns) / (now_stamp - base_stamp);
+
+  int n = __atomic_load_n (&nrings, __ATOMIC_RELAXED);
+  if (n > TRACE_THREADS)
+    n = TRACE_THREADS;
+  for (int i = 0; i < n; i++)
+    {
+      const struct trace_ring *ring = __atomic_load_n (&rings[i],
+                                                       __ATOMIC_ACQUIRE);
+      if (ring != NULL) // NULL while still being set up
+        dump_ring (fd, i, ring, now_stamp, ns_per_tick);
+    }
+  if (spare.next > 0)
+    dump_ring (fd, n, &spare, now_stamp, ns_per_tick);
+}
+
+static void
+on_crash (int sig)
+{
+  static const char banner[] = "Fatal signal, dumping trace\n";
+  if (write (STDERR_FILENO, banner, sizeof (banner) - 1) >= 0)
+    trace_dump (STDERR_FILENO);
+  // the handler was reset, so this kills the process as it would have
+  raise (sig);
+}
+
+void
+trace_install (void)
+{
+  base_stamp = trace_stamp ();
+  base_ns = monotonic_ns ();
+
+  struct sigaction action;
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = on_crash;
+  action.sa_flags = SA_RESETHAND;
+  sigemptyset (&action.sa_mask);
+  const int fatal[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+  for (size_t i = 0; i < sizeof (fatal) / sizeof (fatal[0]); i++)
+    sigaction (fatal[i], &action, NULL);
+}
@@ -0,0 +1,82 @@
+#ifndef __cs361_trace_h__
+#define __cs361_trace_h__
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Flight recorder for the packet path. Every thread has a ring of its last
+// TRACE_RING_SIZE trace points (a timestamp, an event and one argument),
+// written with plain stores and never read on the hot path. trace_dump
+// prints all rings, oldest event first; the server calls it on SIGUSR1,
+// and on a crash through the handlers of trace_install.
+//
+// Timestamps are TSC ticks on x86 and CLOCK_MONOTONIC ns elsewhere; a dump
+// converts them to ns against the monotonic clock.
+
+#define TRACE_RING_SIZE 4096 // events kept per thread, a power of two
+
+enum trace_event
+{
+  TRACE_RECV,   // datagram received; arg is its length (or batch size)
+  TRACE_PARSE,  // options parsed; arg is the message type
+  TRACE_LOOKUP, // reply cache or lease table searched; arg is 1 on a hit
+  TRACE_ALLOC,  // lease assigned; arg is its address, 0 if none was left
+  TRACE_BUILD,  // reply built; arg is its message type
+  TRACE_SEND,   // reply sent; arg is its length (or batch size)
+  TRACE_EVENTS
+};
+
+struct trace_point
+{
+  uint64_t stamp;
+  uint32_t event;
+  uint32_t arg;
+};
+
+struct trace_ring
+{
+  uint64_t next; // points written so far
+  struct trace_point points[TRACE_RING_SIZE];
+};
+
+extern __thread struct trace_ring *trace_self;
+
+// The calling thread's ring, set up on first use
+struct trace_ring *trace_ring (void);
+
+static inline uint64_t
+trace_stamp (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc ();
+#else
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Record a trace point in the calling thread's ring
+static inline void
+trace (enum trace_event event, uint32_t arg)
+{
+  struct trace_ring *ring = trace_self != NULL ? trace_self : trace_ring ();
+  struct trace_point *point = &ring->points[ring->next % TRACE_RING_SIZE];
+  point->stamp = trace_stamp ();
+  point->event = event;
+  point->arg = arg;
+  __atomic_store_n (&ring->next, ring->next + 1, __ATOMIC_RELEASE);
+}
+
+// Write every thread's ring to fd. Only uses async-signal-safe calls.
+void trace_dump (int fd);
+
+// Dump the rings to stderr on SIGSEGV, SIGBUS, SIGFPE, SIGILL and
+// SIGABRT before dying of the signal
+void trace_install (void);
+
+#endif
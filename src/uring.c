@@ -0,0 +1,241 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "uring.h"
+
+#define PAGE_SIZE 4096
+
+struct uring
+{
+  int fd;
+  void *rings; // SQ and CQ rings share one mapping
+  size_t rings_size;
+
+  // submission queue; tail is ours until uring_submit publishes it
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t sq_mask;
+  uint32_t sq_entries;
+  uint32_t tail;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  // completion queue
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe *cqes;
+
+  // provided buffers, with their ring, in one arena
+  arena_t *arena;
+  struct io_uring_buf_ring *buf_ring;
+  uint8_t *bufs;
+  size_t buf_size;
+  uint16_t buf_mask;
+  uint16_t buf_tail;
+};
+
+uring_t *
+uring_open (unsigned entries)
+{
+  struct io_uring_params params;
+  memset (&params, 0, sizeof (params));
+  int fd = syscall (__NR_io_uring_setup, entries, &params);
+  if (fd < 0)
+    return NULL;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+      close (fd);
+      errno = ENOSYS;
+      return NULL;
+    }
+
+  uring_t *ring = calloc (1, sizeof (uring_t));
+  if (ring == NULL)
+    {
+      close (fd);
+      return NULL;
+    }
+  ring->fd = fd;
+  ring->rings = MAP_FAILED;
+  ring->sqes = MAP_FAILED;
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof (uint32_t);
+  size_t cq_size
+      = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+  ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->rings = mmap (NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+      uring_close (ring);
+      return NULL;
+    }
+
+  uint8_t *base = ring->rings;
+  ring->sq_head = (uint32_t *)(base + params.sq_off.head);
+  ring->sq_tail = (uint32_t *)(base + params.sq_off.tail);
+  ring->sq_mask = *(uint32_t *)(base + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->tail = *ring->sq_tail;
+  ring->cq_head = (uint32_t *)(base + params.cq_off.head);
+  ring->cq_tail = (uint32_t *)(base + params.cq_off.tail);
+  ring->cq_mask = *(uint32_t *)(base + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+
+  // submission entry i always sits in slot i
+  uint32_t *array = (uint32_t *)(base + params.sq_off.array);
+  for (uint32_t i = 0; i < params.sq_entries; i++)
+    array[i] = i;
+
+  return ring;
+}
+
+void
+uring_close (uring_t *ring)
+{
+  if (ring == NULL)
+    return;
+  if (ring->sqes != MAP_FAILED)
+    munmap (ring->sqes, ring->sqes_size);
+  if (ring->rings != MAP_FAILED)
+    munmap (ring->rings, ring->rings_size);
+  close (ring->fd);
+  arena_destroy (ring->arena);
+  free (ring);
+}
+
+bool
+uring_buffers (uring_t *ring, uint16_t count, size_t size)
+{
+  size_t ring_size = count * sizeof (struct io_uring_buf);
+  ring->arena = arena_create (PAGE_SIZE + ring_size + count * size);
+  if (ring->arena == NULL)
+    return false;
+  ring->buf_ring = arena_alloc (ring->arena, ring_size, PAGE_SIZE);
+  ring->bufs = arena_alloc (ring->arena, count * size, 64);
+  ring->buf_size = size;
+  ring->buf_mask = count - 1;
+
+  struct io_uring_buf_reg reg;
+  memset (&reg, 0, sizeof (reg));
+  reg.ring_addr = (uintptr_t)ring->buf_ring;
+  reg.ring_entries = count;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (syscall (__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+               &reg, 1)
+      < 0)
+    return false;
+
+  for (uint32_t bid = 0; bid < count; bid++)
+    uring_buffer_return (ring, bid);
+  return true;
+}
+
+uint8_t *
+uring_buffer (uring_t *ring, uint16_t bid)
+{
+  return ring->bufs + (size_t)bid * ring->buf_size;
+}
+
+void
+uring_buffer_return (uring_t *ring, uint16_t bid)
+{
+  // the ring's tail overlays the first entry's reserved field, so only
+  // fill in the other fields
+  struct io_uring_buf *buf
+      = &ring->buf_ring->bufs[ring->buf_tail & ring->buf_mask];
+  buf->addr = (uintptr_t)uring_buffer (ring, bid);
+  buf->len = ring->buf_size;
+  buf->bid = bid;
+  ring->buf_tail++;
+  __atomic_store_n (&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *
+uring_sqe (uring_t *ring)
+{
+  uint32_t head = __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->tail - head >= ring->sq_entries)
+    {
+      if (uring_submit (ring, 0) < 0)
+        return NULL;
+      head = __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+      if (ring->tail - head >= ring->sq_entries)
+        return NULL;
+    }
+
+  struct io_uring_sqe *sqe = &ring->sqes[ring->tail & ring->sq_mask];
+  ring->tail++;
+  memset (sqe, 0, sizeof (struct io_uring_sqe));
+  return sqe;
+}
+
+int
+uring_submit (uring_t *ring, unsigned wait)
+{
+  __atomic_store_n (ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+  unsigned pending
+      = ring->tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+  return syscall (__NR_io_uring_enter, ring->fd, pending, wait, flags, NULL,
+                  0);
+}
+
+struct io_uring_cqe *
+uring_cqe (uring_t *ring)
+{
+  uint32_t head = *ring->cq_head;
+  if (head == __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void
+uring_cqe_seen (uring_t *ring)
+{
+  __atomic_store_n (ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void
+uring_prep_recvmsg_multishot (struct io_uring_sqe *sqe, int fd,
+                              struct msghdr *msg, uint64_t user_data)
+{
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = user_data;
+}
+
+void
+uring_prep_sendmsg (struct io_uring_sqe *sqe, int fd,
+                    const struct msghdr *msg, uint64_t user_data)
+{
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)msg;
+  sqe->len = 1;
+  sqe->user_data = user_data;
+}
+
+void
+uring_prep_poll (struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = user_data;
+}
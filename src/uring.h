@@ -0,0 +1,52 @@
+#ifndef __cs361_uring_h__
+#define __cs361_uring_h__
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Minimal io_uring ring driven through the raw system calls (-u). Each
+// ring has one group of provided receive buffers (URING_BUFFER_GROUP)
+// that the kernel picks from as datagrams arrive, so a single multishot
+// receive keeps the socket drained. Submitting the queued requests and
+// waiting for completions is one io_uring_enter call.
+
+#define URING_BUFFER_GROUP 0
+
+typedef struct uring uring_t;
+
+// Set up a ring with room for entries submissions. Returns NULL (with
+// errno set) if the kernel has no io_uring or it is disabled.
+uring_t *uring_open (unsigned entries);
+void uring_close (uring_t *ring);
+
+// Register count (a power of two) provided buffers of size bytes each,
+// all initially available to the kernel
+bool uring_buffers (uring_t *ring, uint16_t count, size_t size);
+uint8_t *uring_buffer (uring_t *ring, uint16_t bid);
+
+// Hand buffer bid back to the kernel once its contents are used up
+void uring_buffer_return (uring_t *ring, uint16_t bid);
+
+// Next free submission entry, zeroed. Submits the queued ones first if
+// the queue is full; NULL if that fails.
+struct io_uring_sqe *uring_sqe (uring_t *ring);
+
+// Submit everything queued and wait until at least wait completions are
+// ready. Returns what io_uring_enter returns.
+int uring_submit (uring_t *ring, unsigned wait);
+
+// Oldest unconsumed completion, or NULL; uring_cqe_seen consumes it
+struct io_uring_cqe *uring_cqe (uring_t *ring);
+void uring_cqe_seen (uring_t *ring);
+
+// Request preparation
+void uring_prep_recvmsg_multishot (struct io_uring_sqe *sqe, int fd,
+                                   struct msghdr *msg, uint64_t user_data);
+void uring_prep_sendmsg (struct io_uring_sqe *sqe, int fd,
+                         const struct msghdr *msg, uint64_t user_data);
+void uring_prep_poll (struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+
+#endif
@@ -0,0 +1,327 @@
+// Microbenchmarks for the packet codec and the lease table. Every
+// benchmark runs with a doubling iteration count until one run takes at
+// least MIN_RUN_NS, and is reported as ns/op and heap allocations per op
+// (malloc, calloc and realloc are wrapped with --wrap to count them).
+//
+//    ./bench [-o FILE] [-l LABEL] [NAME...]
+//
+// With -o, one JSON object per benchmark is appended to FILE, tagged with
+// LABEL (make bench uses the current commit), so runs from different
+// commits can be compared. Naming benchmarks runs only those.
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/dhcp.h"
+#include "../src/format.h"
+#include "../src/lease.h"
+#include "../src/pool.h"
+
+#define MIN_RUN_NS 200000000LL
+#define MAX_ITERATIONS (1L << 30)
+#define CLIENTS 4096 // distinct clients in the lease benchmarks
+
+// Heap allocations made by the code under test
+static long allocs = 0;
+
+void *__real_malloc (size_t);
+void *__real_calloc (size_t, size_t);
+void *__real_realloc (void *, size_t);
+
+void *
+__wrap_malloc (size_t size)
+{
+  allocs++;
+  return __real_malloc (size);
+}
+
+void *
+__wrap_calloc (size_t count, size_t size)
+{
+  allocs++;
+  return __real_calloc (count, size);
+}
+
+void *
+__wrap_realloc (void *ptr, size_t size)
+{
+  allocs++;
+  return __real_realloc (ptr, size);
+}
+
+// Results go here so the loops cannot be optimized away
+static volatile uintptr_t sink;
+
+static uint8_t request[MAX_DHCP_LENGTH] __attribute__ ((aligned (8)));
+static size_t request_size = 0;
+static FILE *devnull = NULL;
+
+// A REQUEST as a client sends it: cookie, type, requested IP, server ID
+static void
+build_request (void)
+{
+  msg_t *msg = (msg_t *)request;
+  msg->op = BOOTREQUEST;
+  msg->htype = ETH;
+  msg->hlen = ETH_LEN;
+  msg->xid = htonl (42);
+  memcpy (msg->chaddr, "\x00\x1a\x2b\x3c\x4d\x5e", ETH_LEN);
+
+  uint8_t type = DHCPREQUEST;
+  struct in_addr reqip, sid;
+  inet_pton (AF_INET, "192.168.1.1", &reqip);
+  inet_pton (AF_INET, "192.168.1.0", &sid);
+  request_size = sizeof (msg_t);
+  write_cookie (request, &request_size, MAX_DHCP_LENGTH);
+  write_option (request, &request_size, MAX_DHCP_LENGTH, DHCP_opt_msgtype, 1,
+                &type);
+  write_option (request, &request_size, MAX_DHCP_LENGTH, DHCP_opt_reqip,
+                sizeof (reqip), (uint8_t *)&reqip);
+  write_option (request, &request_size, MAX_DHCP_LENGTH, DHCP_opt_sid,
+                sizeof (sid), (uint8_t *)&sid);
+  write_option (request, &request_size, MAX_DHCP_LENGTH, DHCP_opt_end, 0,
+                NULL);
+}
+
+static void
+bench_get_options (long n)
+{
+  uint8_t *start = request + sizeof (msg_t);
+  uint8_t *end = request + request_size - 1;
+  for (long i = 0; i < n; i++)
+    {
+      options_t options;
+      memset (&options, 0, sizeof (options));
+      get_options (start, end, &options);
+      sink = (uintptr_t)options.sid;
+      free_options (&options);
+    }
+}
+
+static void
+bench_parse_options (long n)
+{
+  uint8_t *start = request + sizeof (msg_t);
+  uint8_t *end = request + request_size - 1;
+  for (long i = 0; i < n; i++)
+    {
+      options_t options;
+      memset (&options, 0, sizeof (options));
+      parse_options (start, end, &options);
+      sink = options.sid->s_addr;
+    }
+}
+
+static void
+bench_append_option (long n)
+{
+  uint8_t type = DHCPACK;
+  uint32_t lease = htonl (3600);
+  for (long i = 0; i < n; i++)
+    {
+      size_t size = sizeof (msg_t);
+      uint8_t *packet = calloc (1, size);
+      packet = append_cookie (packet, &size);
+      packet = append_option (packet, &size, DHCP_opt_msgtype, 1, &type);
+      packet = append_option (packet, &size, DHCP_opt_lease, 4,
+                              (uint8_t *)&lease);
+      packet = append_option (packet, &size, DHCP_opt_sid, 4,
+                              request + sizeof (msg_t));
+      packet = append_option (packet, &size, DHCP_opt_end, 0, NULL);
+      sink = size;
+      free (packet);
+    }
+}
+
+static void
+bench_write_option (long n)
+{
+  uint8_t packet[MAX_DHCP_LENGTH];
+  uint8_t type = DHCPACK;
+  uint32_t lease = htonl (3600);
+  for (long i = 0; i < n; i++)
+    {
+      size_t size = sizeof (msg_t);
+      write_cookie (packet, &size, sizeof (packet));
+      write_option (packet, &size, sizeof (packet), DHCP_opt_msgtype, 1,
+                    &type);
+      write_option (packet, &size, sizeof (packet), DHCP_opt_lease, 4,
+                    (uint8_t *)&lease);
+      write_option (packet, &size, sizeof (packet), DHCP_opt_sid, 4,
+                    request + sizeof (msg_t));
+      write_option (packet, &size, sizeof (packet), DHCP_opt_end, 0, NULL);
+      sink = size + packet[size - 1];
+    }
+}
+
+static void
+bench_dump_msg (long n)
+{
+  for (long i = 0; i < n; i++)
+    dump_msg (devnull, (msg_t *)request, request_size);
+}
+
+static void
+make_chaddr (long client, uint8_t *chaddr)
+{
+  memset (chaddr, 0, CHADDR_LEN);
+  memcpy (chaddr, &client, sizeof (client) < ETH_LEN ? sizeof (client)
+                                                     : ETH_LEN);
+}
+
+// One client's whole lease: assign, offer, bind, release
+static void
+bench_lease_cycle (long n)
+{
+  pool_t *pool = pool_create (0x0a000001, CLIENTS);
+  lease_table_t *table = lease_table_create (CLIENTS, pool);
+  uint8_t chaddr[CHADDR_LEN];
+
+  allocs = 0;
+  for (long i = 0; i < n; i++)
+    {
+      make_chaddr (i % CLIENTS, chaddr);
+      struct lease *lease = lease_assign (table, ETH, ETH_LEN, chaddr);
+      lease_offer (table, lease, 60);
+      lease_bind (table, lease, 3600);
+      lease_release (table, lease);
+    }
+  long cycled = allocs;
+  lease_table_destroy (table);
+  pool_destroy (pool);
+  allocs = cycled;
+}
+
+static void
+bench_lease_find (long n)
+{
+  pool_t *pool = pool_create (0x0a000001, CLIENTS);
+  lease_table_t *table = lease_table_create (CLIENTS, pool);
+  uint8_t chaddr[CHADDR_LEN];
+  for (long c = 0; c < CLIENTS; c++)
+    {
+      make_chaddr (c, chaddr);
+      lease_offer (table, lease_assign (table, ETH, ETH_LEN, chaddr), 60);
+    }
+
+  allocs = 0;
+  for (long i = 0; i < n; i++)
+    {
+      make_chaddr (i % CLIENTS, chaddr);
+      sink = (uintptr_t)lease_find (table, ETH, ETH_LEN, chaddr);
+    }
+  long found = allocs;
+  lease_table_destroy (table);
+  pool_destroy (pool);
+  allocs = found;
+}
+
+struct benchmark
+{
+  const char *name;
+  void (*run) (long iterations);
+};
+
+static const struct benchmark benchmarks[] = {
+  { "get_options", bench_get_options },
+  { "parse_options", bench_parse_options },
+  { "append_option", bench_append_option },
+  { "write_option", bench_write_option },
+  { "dump_msg", bench_dump_msg },
+  { "lease_cycle", bench_lease_cycle },
+  { "lease_find", bench_lease_find },
+};
+#define NBENCHMARKS (sizeof (benchmarks) / sizeof (benchmarks[0]))
+
+static int64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+measure (const struct benchmark *bench, FILE *out, const char *label)
+{
+  long n = 1;
+  int64_t elapsed;
+  for (;;)
+    {
+      allocs = 0;
+      int64_t start = now_ns ();
+      bench->run (n);
+      elapsed = now_ns () - start;
+      if (elapsed >= MIN_RUN_NS || n >= MAX_ITERATIONS)
+        break;
+      n *= 2;
+    }
+
+  double ns_per_op = (double)elapsed / n;
+  double allocs_per_op = (double)allocs / n;
+  printf ("%-16s %12ld %12.1f ns/op %8.2f allocs/op\n", bench->name, n,
+          ns_per_op, allocs_per_op);
+  if (out != NULL)
+    fprintf (out,
+             "{\"label\": \"%s\", \"name\": \"%s\", \"iterations\": %ld, "
+             "\"ns_per_op\": %.2f, \"allocs_per_op\": %.3f}\n",
+             label, bench->name, n, ns_per_op, allocs_per_op);
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *path = NULL;
+  const char *label = "";
+  int ch;
+  while ((ch = getopt (argc, argv, "l:o:")) != -1)
+    {
+      switch (ch)
+        {
+        case 'l':
+          label = optarg;
+          break;
+        case 'o':
+          path = optarg;
+          break;
+        default:
+          fprintf (stderr, "usage: %s [-o FILE] [-l LABEL] [NAME...]\n",
+                   argv[0]);
+          return EXIT_FAILURE;
+        }
+    }
+
+  FILE *out = NULL;
+  if (path != NULL && (out = fopen (path, "a")) == NULL)
+    {
+      perror (path);
+      return EXIT_FAILURE;
+    }
+  devnull = fopen ("/dev/null", "w");
+  if (devnull == NULL)
+    {
+      perror ("/dev/null");
+      return EXIT_FAILURE;
+    }
+  build_request ();
+
+  for (size_t b = 0; b < NBENCHMARKS; b++)
+    {
+      bool wanted = optind == argc;
+      for (int i = optind; i < argc; i++)
+        wanted |= strcmp (argv[i], benchmarks[b].name) == 0;
+      if (wanted)
+        measure (&benchmarks[b], out, label);
+    }
+
+  if (out != NULL)
+    fclose (out);
+  fclose (devnull);
+  return EXIT_SUCCESS;
+}
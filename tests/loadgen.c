@@ -0,0 +1,394 @@
+// Load generator: many synthetic clients run full DISCOVER/REQUEST/RELEASE
+// cycles against a running dhcps, and the throughput and latency of the
+// exchanges are reported at the end. The server needs a pool at least as
+// large as the client count, for instance:
+//
+//    ../dhcps -s 0 -v 0 -n 10.0.0.0/16 &
+//    ./loadgen -c 10000 -t 8 -n 5
+//
+// Each thread owns a slice of the clients and a socket, and keeps one
+// request outstanding at a time; add threads to add concurrency.
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/dhcp.h"
+#include "../src/port_utils.h"
+
+struct hw_type
+{
+  uint8_t htype;
+  uint8_t hlen;
+};
+
+static const struct hw_type hw_types[] = {
+  { ETH, ETH_LEN },
+  { IEEE802, IEEE802_LEN },
+  { ARCNET, ARCNET_LEN },
+  { FRAME_RELAY, FRAME_LEN },
+  { FIBRE, FIBRE_LEN },
+};
+#define NTYPES (sizeof (hw_types) / sizeof (hw_types[0]))
+
+struct settings
+{
+  long clients;
+  int threads;
+  long cycles;
+  long timeout_ms;
+  struct sockaddr_in server;
+};
+
+// Latency samples (ns) and outcomes of one thread
+struct results
+{
+  uint64_t *samples;
+  size_t nsamples;
+  size_t capacity;
+  long cycles;   // completed DISCOVER/REQUEST/RELEASE cycles
+  long timeouts; // requests that got no reply in time
+  long naks;
+};
+
+struct loader
+{
+  pthread_t tid;
+  int id;
+  long first; // clients [first, first + count)
+  long count;
+  const struct settings *settings;
+  struct results results;
+};
+
+static int64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Client n gets a hardware type round-robin and its index within that
+// type as address; the one-byte ARCNET addresses run out after 256, so
+// later clients of that slot are Ethernet instead
+static void
+make_client (long n, uint8_t *htype, uint8_t *hlen, uint8_t *chaddr)
+{
+  const struct hw_type *type = &hw_types[n % NTYPES];
+  uint64_t index = n / NTYPES;
+  if (type->hlen == 1 && index > UINT8_MAX)
+    type = &hw_types[0];
+
+  *htype = type->htype;
+  *hlen = type->hlen;
+  memset (chaddr, 0, 16);
+  for (int i = type->hlen - 1; i >= 0; i--, index >>= 8)
+    chaddr[i] = index & 0xff;
+  // keep the Ethernet stand-ins apart from the real Ethernet clients
+  if (type->htype != hw_types[n % NTYPES].htype)
+    chaddr[0] = 0xa0;
+}
+
+static size_t
+make_request (uint8_t *packet, uint8_t type, uint32_t xid, uint8_t htype,
+              uint8_t hlen, const uint8_t *chaddr, struct in_addr *sid,
+              struct in_addr *reqip)
+{
+  memset (packet, 0, MAX_DHCP_LENGTH);
+  msg_t *msg = (msg_t *)packet;
+  msg->op = BOOTREQUEST;
+  msg->htype = htype;
+  msg->hlen = hlen;
+  msg->xid = htonl (xid);
+  memcpy (msg->chaddr, chaddr, 16);
+
+  size_t size = sizeof (msg_t);
+  write_cookie (packet, &size, MAX_DHCP_LENGTH);
+  write_option (packet, &size, MAX_DHCP_LENGTH, DHCP_opt_msgtype, 1, &type);
+  if (reqip != NULL)
+    write_option (packet, &size, MAX_DHCP_LENGTH, DHCP_opt_reqip,
+                  sizeof (struct in_addr), (uint8_t *)reqip);
+  if (sid != NULL)
+    write_option (packet, &size, MAX_DHCP_LENGTH, DHCP_opt_sid,
+                  sizeof (struct in_addr), (uint8_t *)sid);
+  write_option (packet, &size, MAX_DHCP_LENGTH, DHCP_opt_end, 0, NULL);
+  return size;
+}
+
+static void
+record (struct results *results, uint64_t ns)
+{
+  if (results->nsamples == results->capacity)
+    {
+      size_t capacity = results->capacity > 0 ? 2 * results->capacity : 4096;
+      uint64_t *samples
+          = realloc (results->samples, capacity * sizeof (uint64_t));
+      if (samples == NULL)
+        return;
+      results->samples = samples;
+      results->capacity = capacity;
+    }
+  results->samples[results->nsamples++] = ns;
+}
+
+// Send a request and wait for the reply with the same xid. Returns the
+// reply's message type, or 0 on a timeout.
+static uint8_t
+exchange (int sock, uint8_t *packet, size_t size, uint8_t *reply,
+          options_t *options, struct results *results)
+{
+  uint32_t xid = ((msg_t *)packet)->xid;
+  int64_t start = now_ns ();
+  if (send (sock, packet, size, 0) < 0)
+    {
+      perror ("send");
+      return 0;
+    }
+
+  for (;;)
+    {
+      memset (reply, 0, MAX_DHCP_LENGTH);
+      ssize_t bytes = recv (sock, reply, MAX_DHCP_LENGTH, 0);
+      if (bytes < 0)
+        {
+          results->timeouts++;
+          return 0;
+        }
+      // late replies to requests that already timed out are skipped
+      msg_t *msg = (msg_t *)reply;
+      if (bytes <= (ssize_t)sizeof (msg_t) || msg->xid != xid)
+        continue;
+      record (results, now_ns () - start);
+
+      memset (options, 0, sizeof (options_t));
+      parse_options (reply + sizeof (msg_t), reply + bytes - 1, options);
+      return options->type != NULL ? *options->type : 0;
+    }
+}
+
+static void *
+run_loader (void *arg)
+{
+  struct loader *self = (struct loader *)arg;
+  const struct settings *settings = self->settings;
+
+  int sock = socket (AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0)
+    {
+      perror ("socket");
+      return NULL;
+    }
+  struct timeval timeout;
+  timeout.tv_sec = settings->timeout_ms / 1000;
+  timeout.tv_usec = (settings->timeout_ms % 1000) * 1000;
+  if (setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout))
+          < 0
+      || connect (sock, (struct sockaddr *)&settings->server,
+                  sizeof (settings->server))
+             < 0)
+    {
+      perror ("connect");
+      close (sock);
+      return NULL;
+    }
+
+  uint8_t packet[MAX_DHCP_LENGTH] __attribute__ ((aligned (8)));
+  uint8_t reply[MAX_DHCP_LENGTH] __attribute__ ((aligned (8)));
+  options_t options;
+  // xid 0 would end the server's first phase; threads never share xids
+  uint32_t xid = (uint32_t)(self->id + 1) << 24;
+
+  for (long cycle = 0; cycle < settings->cycles; cycle++)
+    {
+      for (long n = self->first; n < self->first + self->count; n++)
+        {
+          uint8_t htype, hlen, chaddr[16];
+          make_client (n, &htype, &hlen, chaddr);
+
+          xid++;
+          size_t size = make_request (packet, DHCPDISCOVER, xid, htype, hlen,
+                                      chaddr, NULL, NULL);
+          uint8_t type = exchange (sock, packet, size, reply, &options,
+                                   &self->results);
+          if (type != DHCPOFFER || options.sid == NULL)
+            {
+              self->results.naks += type == DHCPNAK;
+              continue;
+            }
+          struct in_addr yiaddr = ((msg_t *)reply)->yiaddr;
+          struct in_addr sid = *options.sid;
+
+          size = make_request (packet, DHCPREQUEST, xid, htype, hlen, chaddr,
+                               &sid, &yiaddr);
+          type = exchange (sock, packet, size, reply, &options,
+                           &self->results);
+          if (type != DHCPACK)
+            {
+              self->results.naks += type == DHCPNAK;
+              continue;
+            }
+
+          size = make_request (packet, DHCPRELEASE, xid, htype, hlen, chaddr,
+                               &sid, &yiaddr);
+          if (send (sock, packet, size, 0) < 0)
+            perror ("send");
+          self->results.cycles++;
+        }
+    }
+
+  close (sock);
+  return NULL;
+}
+
+static int
+compare_samples (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double
+percentile_us (const uint64_t *sorted, size_t n, double p)
+{
+  if (n == 0)
+    return 0;
+  size_t i = (size_t)(p * (n - 1) + 0.5);
+  return sorted[i] / 1000.0;
+}
+
+static void
+usage (const char *name)
+{
+  fprintf (stderr,
+           "usage: %s [-c CLIENTS] [-t THREADS] [-n CYCLES] [-w MS] "
+           "[-a ADDR] [-p PORT]\n",
+           name);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct settings settings;
+  memset (&settings, 0, sizeof (settings));
+  settings.clients = 1000;
+  settings.threads = 4;
+  settings.cycles = 1;
+  settings.timeout_ms = 500;
+  settings.server.sin_family = AF_INET;
+  settings.server.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  char *port = NULL;
+
+  int ch;
+  while ((ch = getopt (argc, argv, "a:c:n:p:t:w:")) != -1)
+    {
+      switch (ch)
+        {
+        case 'a':
+          if (inet_pton (AF_INET, optarg, &settings.server.sin_addr) != 1)
+            {
+              usage (argv[0]);
+              return EXIT_FAILURE;
+            }
+          break;
+        case 'c':
+          settings.clients = atol (optarg);
+          break;
+        case 'n':
+          settings.cycles = atol (optarg);
+          break;
+        case 'p':
+          port = optarg;
+          break;
+        case 't':
+          settings.threads = atoi (optarg);
+          break;
+        case 'w':
+          settings.timeout_ms = atol (optarg);
+          break;
+        default:
+          usage (argv[0]);
+          return EXIT_FAILURE;
+        }
+    }
+  if (settings.clients < 1 || settings.threads < 1 || settings.cycles < 1
+      || settings.timeout_ms < 1 || settings.threads > 255)
+    {
+      usage (argv[0]);
+      return EXIT_FAILURE;
+    }
+  if (settings.threads > settings.clients)
+    settings.threads = settings.clients;
+  if (port == NULL)
+    port = get_port ();
+  settings.server.sin_port = htons (atoi (port));
+
+  struct loader *loaders = calloc (settings.threads, sizeof (struct loader));
+  if (loaders == NULL)
+    {
+      perror ("calloc");
+      return EXIT_FAILURE;
+    }
+
+  int64_t start = now_ns ();
+  long first = 0;
+  int started = 0;
+  for (int i = 0; i < settings.threads; i++)
+    {
+      loaders[i].id = i;
+      loaders[i].settings = &settings;
+      loaders[i].first = first;
+      loaders[i].count = settings.clients / settings.threads
+                         + (i < settings.clients % settings.threads ? 1 : 0);
+      first += loaders[i].count;
+      if (pthread_create (&loaders[i].tid, NULL, run_loader, &loaders[i])
+          != 0)
+        {
+          perror ("pthread_create");
+          break;
+        }
+      started++;
+    }
+  for (int i = 0; i < started; i++)
+    pthread_join (loaders[i].tid, NULL);
+  double seconds = (now_ns () - start) / 1e9;
+
+  // merge every thread's samples for the percentiles
+  struct results total;
+  memset (&total, 0, sizeof (total));
+  for (int i = 0; i < started; i++)
+    {
+      struct results *r = &loaders[i].results;
+      for (size_t s = 0; s < r->nsamples; s++)
+        record (&total, r->samples[s]);
+      total.cycles += r->cycles;
+      total.timeouts += r->timeouts;
+      total.naks += r->naks;
+      free (r->samples);
+    }
+  qsort (total.samples, total.nsamples, sizeof (uint64_t), compare_samples);
+
+  printf ("clients %ld threads %d cycles %ld in %.3f s\n", settings.clients,
+          started, total.cycles, seconds);
+  printf ("exchanges %zu (%.0f/s), leases %.0f/s, timeouts %ld, naks %ld\n",
+          total.nsamples, total.nsamples / seconds, total.cycles / seconds,
+          total.timeouts, total.naks);
+  printf ("latency us: p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+          percentile_us (total.samples, total.nsamples, 0.50),
+          percentile_us (total.samples, total.nsamples, 0.99),
+          percentile_us (total.samples, total.nsamples, 0.999),
+          percentile_us (total.samples, total.nsamples, 1.0));
+
+  free (total.samples);
+  free (loaders);
+  return total.timeouts > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,6 +1,7 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <check.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <netdb.h>
@@ -13,6 +14,12 @@
 #include <unistd.h>
 
 #include "../src/dhcp.h"
+#include "../src/journal.h"
+#include "../src/lease.h"
+#include "../src/leasedb.h"
+#include "../src/metrics.h"
+#include "../src/pool.h"
+#include "../src/ratelimit.h"
 
 START_TEST (C_test_template)
 {
@@ -47,12 +54,457 @@ START_TEST (test_append_option)
 }
 END_TEST
 
+START_TEST (test_write_option_bounds)
+{
+  uint8_t packet[8];
+  size_t size = 0;
+  uint8_t value[4] = { 1, 2, 3, 4 };
+
+  ck_assert (write_cookie (packet, &size, sizeof (packet)));
+  ck_assert_int_eq (size, 4);
+  // 2 + 4 bytes would not fit in the remaining 4
+  ck_assert (!write_option (packet, &size, sizeof (packet), DHCP_opt_sid, 4,
+                            value));
+  ck_assert_int_eq (size, 4);
+  ck_assert (write_option (packet, &size, sizeof (packet), DHCP_opt_msgtype,
+                           1, value));
+  ck_assert_int_eq (size, 7);
+  ck_assert_int_eq (packet[4], DHCP_opt_msgtype);
+}
+END_TEST
+
+START_TEST (test_parse_options_inline)
+{
+  uint8_t *packet = malloc (0);
+  size_t size = 0;
+  uint8_t type = DHCPREQUEST;
+  uint8_t sid[] = { 192, 168, 1, 0 };
+  uint8_t end = DHCP_opt_end;
+
+  packet = append_cookie (packet, &size);
+  packet = append_option (packet, &size, DHCP_opt_msgtype, 1, &type);
+  packet = append_option (packet, &size, DHCP_opt_sid, 4, sid);
+  packet = append_option (packet, &size, DHCP_opt_end, 0, &end);
+
+  options_t opts;
+  memset (&opts, 0, sizeof (opts));
+  ck_assert (parse_options (packet, packet + size - 1, &opts));
+  ck_assert_ptr_eq (opts.type, &opts.type_val);
+  ck_assert_int_eq (*opts.type, DHCPREQUEST);
+  ck_assert_mem_eq (opts.sid, sid, 4);
+  ck_assert_ptr_null (opts.request);
+  ck_assert_ptr_null (opts.lease);
+
+  // the allocating parser still hands out heap copies
+  options_t heap;
+  memset (&heap, 0, sizeof (heap));
+  ck_assert (get_options (packet, packet + size - 1, &heap));
+  ck_assert_ptr_ne (heap.type, &heap.type_val);
+  ck_assert_int_eq (*heap.type, DHCPREQUEST);
+  free_options (&heap);
+  ck_assert_ptr_null (heap.type);
+  free (packet);
+}
+END_TEST
+
+START_TEST (test_lease_tombstone_reuse)
+{
+  struct in_addr first;
+  inet_pton (AF_INET, "192.168.1.1", &first);
+  pool_t *pool = pool_create (ntohl (first.s_addr), 2);
+  lease_table_t *table = lease_table_create (2, pool);
+  uint8_t a[] = { 0xc0, 0xd1, 0xe2 };
+  uint8_t b[] = { 0xa8, 0xb6, 0xc4 };
+
+  struct lease *la = lease_assign (table, FIBRE, FIBRE_LEN, a);
+  struct lease *lb = lease_assign (table, FIBRE, FIBRE_LEN, b);
+  ck_assert_int_eq (ntohl (lb->ip.s_addr) - ntohl (la->ip.s_addr), 1);
+
+  lease_release (table, la);
+  ck_assert_ptr_null (lease_find (table, FIBRE, FIBRE_LEN, a));
+
+  // the released client gets its old address back
+  ck_assert_ptr_eq (lease_assign (table, FIBRE, FIBRE_LEN, a), la);
+  lease_table_destroy (table);
+  pool_destroy (pool);
+}
+END_TEST
+
+START_TEST (test_lease_exhausted)
+{
+  struct in_addr first;
+  inet_pton (AF_INET, "192.168.1.1", &first);
+  pool_t *pool = pool_create (ntohl (first.s_addr), 1);
+  lease_table_t *table = lease_table_create (1, pool);
+  uint8_t a[] = { 0xc0 };
+  uint8_t b[] = { 0xa8 };
+
+  struct lease *la = lease_assign (table, ARCNET, ARCNET_LEN, a);
+  ck_assert_ptr_null (lease_assign (table, ARCNET, ARCNET_LEN, b));
+
+  // once released, another client may take over the slot
+  lease_release (table, la);
+  ck_assert_ptr_eq (lease_assign (table, ARCNET, ARCNET_LEN, b), la);
+  ck_assert_ptr_null (lease_lookup (table, ARCNET, ARCNET_LEN, a));
+  lease_table_destroy (table);
+  pool_destroy (pool);
+}
+END_TEST
+
+START_TEST (test_lease_shared_pool)
+{
+  // -r -t 4: four tables over the 8 slots of one subnet, -c 8 of a /28
+  pool_t *pool = pool_create (0x0a000001, 14);
+  lease_store_t *store = lease_store_create (8, pool, 4);
+  ck_assert_ptr_nonnull (store);
+  lease_table_t *tables[4];
+  for (int t = 0; t < 4; t++)
+    tables[t] = lease_store_table (store, t);
+
+  // every slot can go to clients that all land in table 0
+  uint8_t chaddr[ETH_LEN] = { 0x02 };
+  struct lease *leases[8];
+  int assigned = 0;
+  for (int c = 0; assigned < 8; c++)
+    {
+      chaddr[5] = c;
+      if (lease_store_pick (store, ETH, ETH_LEN, chaddr) != 0)
+        continue;
+      leases[assigned] = lease_assign (tables[0], ETH, ETH_LEN, chaddr);
+      ck_assert_ptr_nonnull (leases[assigned]);
+      ck_assert_int_eq (ntohl (leases[assigned]->ip.s_addr),
+                        0x0a000001 + assigned);
+      assigned++;
+    }
+  chaddr[5] = 0xff;
+  ck_assert_ptr_null (lease_assign (tables[1], ETH, ETH_LEN, chaddr));
+
+  // a tombstone in table 0 hands its slot and address over to table 1
+  ck_assert (!lease_reclaim (tables[1]));
+  lease_release (tables[0], leases[3]);
+  ck_assert (lease_reclaim (tables[0]));
+  struct lease *moved = lease_assign (tables[1], ETH, ETH_LEN, chaddr);
+  ck_assert_ptr_nonnull (moved);
+  ck_assert_int_eq (ntohl (moved->ip.s_addr), 0x0a000004);
+  ck_assert_ptr_eq (lease_lookup (tables[1], ETH, ETH_LEN, chaddr), moved);
+
+  lease_store_destroy (store);
+  pool_destroy (pool);
+}
+END_TEST
+
+START_TEST (test_lease_expiry)
+{
+  struct in_addr first;
+  inet_pton (AF_INET, "192.168.1.1", &first);
+  pool_t *pool = pool_create (ntohl (first.s_addr), 2);
+  lease_table_t *table = lease_table_create (2, pool);
+  uint8_t a[] = { 0xc0 };
+  uint8_t b[] = { 0xa8 };
+
+  // far enough out to cascade down through several wheel levels
+  struct lease *la = lease_assign (table, ARCNET, ARCNET_LEN, a);
+  struct lease *lb = lease_assign (table, ARCNET, ARCNET_LEN, b);
+  lease_set_expiry (table, la, 5000);
+  lease_set_expiry (table, lb, 60);
+
+  ck_assert_int_eq (lease_expire (table, 59), 0);
+  ck_assert_int_eq (lease_expire (table, 60), 1);
+  ck_assert_ptr_null (lease_find (table, ARCNET, ARCNET_LEN, b));
+  ck_assert_int_eq (lease_expire (table, 4999), 0);
+  ck_assert_ptr_eq (lease_find (table, ARCNET, ARCNET_LEN, a), la);
+  ck_assert_int_eq (lease_expire (table, 5000), 1);
+  ck_assert_ptr_null (lease_find (table, ARCNET, ARCNET_LEN, a));
+  lease_table_destroy (table);
+  pool_destroy (pool);
+}
+END_TEST
+
+START_TEST (test_lease_states)
+{
+  // two hot records per cache line
+  ck_assert_int_eq (sizeof (struct lease), 32);
+
+  struct in_addr first;
+  inet_pton (AF_INET, "192.168.1.1", &first);
+  pool_t *pool = pool_create (ntohl (first.s_addr), 2);
+  lease_table_t *table = lease_table_create (2, pool);
+  uint8_t a[] = { 0xc0 };
+
+  struct lease *la = lease_assign (table, ARCNET, ARCNET_LEN, a);
+  ck_assert_int_eq (la->state, LEASE_RESERVED);
+  lease_offer (table, la, 60);
+  ck_assert_int_eq (la->state, LEASE_OFFERED);
+  lease_withdraw (table, la);
+  ck_assert_int_eq (la->state, LEASE_RESERVED);
+  lease_offer (table, la, 60);
+  lease_bind (table, la, 3600);
+  ck_assert_int_eq (la->state, LEASE_BOUND);
+
+  // a new offer to a bound client never cuts its binding short
+  lease_offer (table, la, 120);
+  ck_assert_int_eq (lease_expire (table, 120), 0);
+  ck_assert_int_eq (lease_expire (table, 3600), 1);
+  ck_assert_int_eq (la->state, LEASE_RELEASED);
+  lease_table_destroy (table);
+  pool_destroy (pool);
+}
+END_TEST
+
+START_TEST (test_lease_key_padding)
+{
+  struct in_addr first;
+  inet_pton (AF_INET, "192.168.1.1", &first);
+  pool_t *pool = pool_create (ntohl (first.s_addr), 2);
+  lease_table_t *table = lease_table_create (2, pool);
+
+  // only the first hlen bytes of chaddr are part of the key
+  uint8_t a[CHADDR_LEN] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0xde, 0xad };
+  uint8_t b[CHADDR_LEN] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0xbe, 0xef };
+  struct lease *la = lease_assign (table, ETH, ETH_LEN, a);
+  ck_assert_ptr_eq (lease_lookup (table, ETH, ETH_LEN, b), la);
+  ck_assert_uint_eq (lease_key_hash (ETH, ETH_LEN, a),
+                     lease_key_hash (ETH, ETH_LEN, b));
+  ck_assert_ptr_null (lease_lookup (table, ETH, 8, a));
+  ck_assert_ptr_null (lease_lookup (table, ARCNET, ETH_LEN, a));
+  lease_table_destroy (table);
+  pool_destroy (pool);
+}
+END_TEST
+
+START_TEST (test_lease_db_restart)
+{
+  char path[] = "/tmp/leasedb-XXXXXX";
+  close (mkstemp (path));
+  struct in_addr first;
+  inet_pton (AF_INET, "192.168.1.1", &first);
+  pool_t *pool = pool_create (ntohl (first.s_addr), 4);
+  uint8_t a[] = { 0xc0 };
+  uint8_t b[] = { 0xa8 };
+
+  lease_db_t *db = lease_db_open (path, 4, 1, first);
+  ck_assert_ptr_nonnull (db);
+  lease_table_t *table = lease_table_create (4, pool);
+  ck_assert_int_eq (lease_table_attach (table, lease_db_records (db), 1000),
+                    0);
+  struct lease *la = lease_assign (table, ARCNET, ARCNET_LEN, a);
+  struct lease *lb = lease_assign (table, ARCNET, ARCNET_LEN, b);
+  lease_set_expiry (table, la, 100);
+  lease_set_expiry (table, lb, 100);
+  // a client with no hardware address is keyed by its empty chaddr
+  lease_set_expiry (table, lease_assign (table, ARCNET, 0, b), 100);
+  in_addr_t ip_b = lb->ip.s_addr;
+  lease_release (table, la);
+  lease_table_destroy (table);
+  lease_db_close (db);
+
+  // a's tombstone and the other leases survive, deadlines rebased
+  db = lease_db_open (path, 4, 1, first);
+  ck_assert (!lease_db_recovered (db));
+  pool_destroy (pool);
+  pool = pool_create (ntohl (first.s_addr), 4);
+  table = lease_table_create (4, pool);
+  ck_assert_int_eq (lease_table_attach (table, lease_db_records (db), 1050),
+                    2);
+  ck_assert_ptr_null (lease_find (table, ARCNET, ARCNET_LEN, a));
+  ck_assert_ptr_nonnull (lease_find (table, ARCNET, 0, b));
+  struct lease *restored = lease_find (table, ARCNET, ARCNET_LEN, b);
+  ck_assert_ptr_nonnull (restored);
+  ck_assert_int_eq (restored->ip.s_addr, ip_b);
+  ck_assert_int_eq (lease_expire (table, 49), 0);
+  ck_assert_int_eq (lease_expire (table, 50), 2);
+  la = lease_assign (table, ARCNET, ARCNET_LEN, a);
+  ck_assert_int_eq (ntohl (la->ip.s_addr), ntohl (first.s_addr));
+  lease_table_destroy (table);
+  lease_db_close (db);
+
+  // another geometry is refused without touching the bindings, but the
+  // records load into any number of tables
+  ck_assert_ptr_null (lease_db_open (path, 8, 2, first));
+  ck_assert_int_eq (errno, EINVAL);
+  db = lease_db_open (path, 4, 1, first);
+  ck_assert_ptr_nonnull (db);
+  pool_destroy (pool);
+  pool = pool_create (ntohl (first.s_addr), 4);
+  lease_store_t *store = lease_store_create (4, pool, 3);
+  lease_store_attach (store, lease_db_records (db), 1050);
+  table = lease_store_table (
+      store, lease_store_pick (store, ARCNET, ARCNET_LEN, b));
+  restored = lease_lookup (table, ARCNET, ARCNET_LEN, b);
+  ck_assert_ptr_nonnull (restored);
+  ck_assert_int_eq (restored->ip.s_addr, ip_b);
+  lease_store_destroy (store);
+  pool_destroy (pool);
+  lease_db_close (db);
+  unlink (path);
+}
+END_TEST
+
+START_TEST (test_journal_replay)
+{
+  char db_path[] = "/tmp/leasedb-XXXXXX";
+  char journal_path[] = "/tmp/journal-XXXXXX";
+  close (mkstemp (db_path));
+  close (mkstemp (journal_path));
+  struct in_addr first;
+  inet_pton (AF_INET, "192.168.1.1", &first);
+  pool_t *pool = pool_create (ntohl (first.s_addr), 4);
+  uint8_t a[] = { 0xc0 };
+
+  lease_db_t *db = lease_db_open (db_path, 4, 1, first);
+  ck_assert_int_eq (journal_replay (journal_path, db), 0);
+  journal_t *journal = journal_open (journal_path, db, 1, 16);
+  ck_assert_ptr_nonnull (journal);
+  lease_table_t *table = lease_table_create (4, pool);
+  lease_table_attach (table, lease_db_records (db), 1000);
+  lease_table_journal (table, journal, 0);
+  struct lease *la = lease_assign (table, ARCNET, ARCNET_LEN, a);
+  lease_set_expiry (table, la, 100);
+  ck_assert_int_eq (lease_table_lsn (table), 1);
+  journal_wait (journal, lease_table_lsn (table));
+
+  // keep the durable journal, then lose every store to the database
+  struct journal_entry saved;
+  FILE *file = fopen (journal_path, "rb");
+  ck_assert_int_eq (fread (&saved, sizeof (saved), 1, file), 1);
+  fclose (file);
+  lease_table_destroy (table);
+  journal_close (journal);
+  memset (lease_db_records (db), 0, 4 * sizeof (struct lease_record));
+  lease_db_checkpoint (db, 0);
+  lease_db_close (db);
+  file = fopen (journal_path, "wb");
+  fwrite (&saved, sizeof (saved), 1, file);
+  fclose (file);
+
+  db = lease_db_open (db_path, 4, 1, first);
+  ck_assert_int_eq (journal_replay (journal_path, db), 1);
+  ck_assert_int_eq (lease_db_snapshot_lsn (db), 1);
+  pool_destroy (pool);
+  pool = pool_create (ntohl (first.s_addr), 4);
+  table = lease_table_create (4, pool);
+  ck_assert_int_eq (lease_table_attach (table, lease_db_records (db), 1000),
+                    1);
+  ck_assert_ptr_nonnull (lease_find (table, ARCNET, ARCNET_LEN, a));
+  lease_table_destroy (table);
+  pool_destroy (pool);
+  lease_db_close (db);
+  unlink (db_path);
+  unlink (journal_path);
+}
+END_TEST
+
+START_TEST (test_pool_cidr_exclude)
+{
+  uint32_t first, count, lo, hi;
+  ck_assert (pool_parse_cidr ("10.1.2.3/16", &first, &count));
+  ck_assert_int_eq (first, 0x0a010001);
+  ck_assert_int_eq (count, 65534);
+  ck_assert (!pool_parse_cidr ("10.1.0.0", &first, &count));
+  ck_assert (pool_parse_range ("10.1.0.1-10.1.0.200", &lo, &hi));
+
+  pool_t *pool = pool_create (first, count);
+  pool_exclude (pool, lo, hi);
+  ck_assert_int_eq (pool_available (pool), 65534 - 200);
+
+  // lowest available first, and a freed address is the next one out
+  struct in_addr ip;
+  ck_assert (pool_alloc (pool, &ip));
+  ck_assert_int_eq (ntohl (ip.s_addr), 0x0a0100c9);
+  struct in_addr low = ip;
+  for (int i = 0; i < 1000; i++)
+    ck_assert (pool_alloc (pool, &ip));
+  pool_free (pool, low);
+  ck_assert (pool_alloc (pool, &ip));
+  ck_assert_int_eq (ip.s_addr, low.s_addr);
+  ck_assert (!pool_reserve (pool, low));
+  pool_destroy (pool);
+}
+END_TEST
+
+START_TEST (test_metrics_histogram)
+{
+  // every latency from 1 to 100000 ns once
+  struct metrics *metrics = metrics_self ();
+  for (uint64_t ns = 1; ns <= 100000; ns++)
+    metrics_latency (metrics, ns);
+  ck_assert_int_eq (metrics_quantile (metrics->latency, 0), 1);
+  const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1 };
+  for (size_t q = 0; q < sizeof (quantiles) / sizeof (quantiles[0]); q++)
+    {
+      double exact = quantiles[q] * 100000;
+      double got = metrics_quantile (metrics->latency, quantiles[q]);
+      ck_assert (got >= exact && got <= exact * 1.0625);
+    }
+
+  // the +Inf bucket of the scrape holds every value
+  char text[65536];
+  FILE *out = fmemopen (text, sizeof (text), "w");
+  metrics_write (out);
+  fclose (out);
+  ck_assert_ptr_nonnull (
+      strstr (text, "dhcps_reply_latency_seconds_count 100000\n"));
+}
+END_TEST
+
+START_TEST (test_ratelimit_burst)
+{
+  // 10 packets per second, 3 back to back
+  ratelimit_t *limiter = ratelimit_create (10, 3);
+  uint8_t a[CHADDR_LEN] = { 0x00, 0x1a, 0x2b, 0x3c, 0x4d, 0x5e };
+  uint8_t b[CHADDR_LEN] = { 0x00, 0x1a, 0x2b, 0x3c, 0x4d, 0x5f };
+  uint32_t ka = lease_key_hash (ETH, ETH_LEN, a);
+  uint32_t kb = lease_key_hash (ETH, ETH_LEN, b);
+  int64_t now = 1000000000;
+
+  for (int i = 0; i < 3; i++)
+    ck_assert (ratelimit_allow (limiter, ka, now));
+  ck_assert (!ratelimit_allow (limiter, ka, now));
+  ck_assert (!ratelimit_allow (limiter, ka, now + 50000000));
+  ck_assert (ratelimit_allow (limiter, kb, now));
+
+  // one more every 100 ms, and the full burst after a quiet 300 ms
+  ck_assert (ratelimit_allow (limiter, ka, now + 100000000));
+  ck_assert (!ratelimit_allow (limiter, ka, now + 100000000));
+  now += 400000000;
+  for (int i = 0; i < 3; i++)
+    ck_assert (ratelimit_allow (limiter, ka, now));
+  ck_assert (!ratelimit_allow (limiter, ka, now));
+  ratelimit_destroy (limiter);
+
+  double rate, burst;
+  ck_assert (ratelimit_parse ("50", &rate, &burst));
+  ck_assert (rate == 50 && burst == 50);
+  ck_assert (ratelimit_parse ("0.5:4", &rate, &burst));
+  ck_assert (rate == 0.5 && burst == 4);
+  ck_assert (!ratelimit_parse ("5:0", &rate, &burst));
+  ck_assert (!ratelimit_parse ("5x", &rate, &burst));
+  ck_assert (!ratelimit_parse ("nan", &rate, &burst));
+  ck_assert (!ratelimit_parse ("inf", &rate, &burst));
+  ck_assert (!ratelimit_parse ("1e-400", &rate, &burst));
+  ck_assert (!ratelimit_parse ("5:inf", &rate, &burst));
+}
+END_TEST
+
 void public_tests (Suite *s)
 {
   TCase *tc_public = tcase_create ("Public");
   tcase_add_test (tc_public, C_test_template);
   tcase_add_test (tc_public, test_append_cookie);
   tcase_add_test (tc_public, test_append_option);
+  tcase_add_test (tc_public, test_write_option_bounds);
+  tcase_add_test (tc_public, test_parse_options_inline);
+  tcase_add_test (tc_public, test_lease_tombstone_reuse);
+  tcase_add_test (tc_public, test_lease_exhausted);
+  tcase_add_test (tc_public, test_lease_shared_pool);
+  tcase_add_test (tc_public, test_lease_expiry);
+  tcase_add_test (tc_public, test_lease_states);
+  tcase_add_test (tc_public, test_lease_key_padding);
+  tcase_add_test (tc_public, test_lease_db_restart);
+  tcase_add_test (tc_public, test_journal_replay);
+  tcase_add_test (tc_public, test_pool_cidr_exclude);
+  tcase_add_test (tc_public, test_metrics_histogram);
+  tcase_add_test (tc_public, test_ratelimit_burst);
   suite_add_tcase (s, tc_public);
 }
 